@@ -0,0 +1,171 @@
+#include "collectiontree.h"
+
+#include <QDir>
+#include <QStringList>
+
+CollectionTree::CollectionTree()
+{
+}
+
+void CollectionTree::clear()
+{
+  mNodes.clear();
+  mRoots.clear();
+  mNames.clear();
+  mNameIds.clear();
+  mChildren.clear();
+}
+
+int CollectionTree::addRoot( const QString &path )
+{
+  Node node;
+  node.parent = -1;
+  node.name = internName( path );
+
+  mNodes.append( node );
+  mRoots.append( mNodes.count() - 1 );
+
+  return mNodes.count() - 1;
+}
+
+int CollectionTree::addNode( int parent, const QString &name )
+{
+  Node node;
+  node.parent = parent;
+  node.name = internName( name );
+
+  const quint64 key = childKey( parent, node.name );
+
+  const QHash<quint64, int>::const_iterator it = mChildren.constFind( key );
+  if ( it != mChildren.constEnd() )
+    return it.value();
+
+  mNodes.append( node );
+  mChildren.insert( key, mNodes.count() - 1 );
+
+  return mNodes.count() - 1;
+}
+
+void CollectionTree::renameNode( int node, const QString &name )
+{
+  Node &n = mNodes[node];
+
+  mChildren.remove( childKey( n.parent, n.name ) );
+  n.name = internName( name );
+  mChildren.insert( childKey( n.parent, n.name ), node );
+}
+
+void CollectionTree::moveNode( int node, int parent )
+{
+  Node &n = mNodes[node];
+
+  mChildren.remove( childKey( n.parent, n.name ) );
+  n.parent = parent;
+  mChildren.insert( childKey( n.parent, n.name ), node );
+}
+
+void CollectionTree::removeNode( int node )
+{
+  Node &n = mNodes[node];
+
+  // Descendants become unreachable with it, the slots are reclaimed by the next clear()
+  mChildren.remove( childKey( n.parent, n.name ) );
+  n.parent = -2;
+}
+
+int CollectionTree::find( const QString &path ) const
+{
+  foreach ( int root, mRoots ) {
+    const QString &rootPath = mNames.at( mNodes.at( root ).name );
+
+    if ( path == rootPath )
+      return root;
+
+    if ( !path.startsWith( rootPath + QDir::separator() ) )
+      continue;
+
+    int node = root;
+
+    foreach ( const QString &component, path.mid( rootPath.length() + 1 ).split( QDir::separator(), QString::SkipEmptyParts ) ) {
+      const int name = mNameIds.value( component, -1 );
+      if ( name < 0 )
+        return -1;
+
+      node = mChildren.value( childKey( node, name ), -1 );
+      if ( node < 0 )
+        return -1;
+    }
+
+    return node;
+  }
+
+  return -1;
+}
+
+QList<int> CollectionTree::children( int node ) const
+{
+  // Not indexed, only needed when checking a single directory against the disk
+  QList<int> nodes;
+
+  for ( int i = 0; i < mNodes.count(); ++i ) {
+    if ( mNodes.at( i ).parent == node )
+      nodes << i;
+  }
+
+  return nodes;
+}
+
+bool CollectionTree::isRoot( int node ) const
+{
+  return mNodes.at( node ).parent == -1;
+}
+
+int CollectionTree::parent( int node ) const
+{
+  return mNodes.at( node ).parent;
+}
+
+QString CollectionTree::name( int node ) const
+{
+  return mNames.at( mNodes.at( node ).name );
+}
+
+int CollectionTree::count() const
+{
+  return mNodes.count();
+}
+
+int CollectionTree::memoryUsage() const
+{
+  int bytes = sizeof( CollectionTree );
+
+  bytes += mNodes.capacity() * sizeof( Node );
+  bytes += mRoots.capacity() * sizeof( int );
+
+  // QString data header plus UTF-16 characters, stored once and referenced from the id hash
+  foreach ( const QString &name, mNames )
+    bytes += sizeof( QString ) + 2 * sizeof( int ) + sizeof( void* ) + name.capacity() * sizeof( QChar );
+
+  // Hash nodes carry next pointer and hash value besides key and value
+  bytes += mNameIds.capacity() * sizeof( void* ) + mNameIds.count() * ( sizeof( void* ) + sizeof( uint ) + sizeof( QString ) + sizeof( int ) );
+  bytes += mChildren.capacity() * sizeof( void* ) + mChildren.count() * ( sizeof( void* ) + sizeof( uint ) + sizeof( quint64 ) + sizeof( int ) );
+
+  return bytes;
+}
+
+quint64 CollectionTree::childKey( int parent, int name )
+{
+  return ( quint64( quint32( parent ) ) << 32 ) | quint32( name );
+}
+
+int CollectionTree::internName( const QString &name )
+{
+  const QHash<QString, int>::const_iterator it = mNameIds.constFind( name );
+  if ( it != mNameIds.constEnd() )
+    return it.value();
+
+  mNames.append( name );
+  mNameIds.insert( name, mNames.count() - 1 );
+
+  return mNames.count() - 1;
+}
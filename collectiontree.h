@@ -0,0 +1,57 @@
+#ifndef COLLECTIONTREE_H
+#define COLLECTIONTREE_H
+
+#include <QHash>
+#include <QList>
+#include <QString>
+#include <QVector>
+
+/**
+ * Compact in-memory model of the notes directory hierarchy.
+ *
+ * Nodes are stored in a flat array and refer to their parent by index,
+ * directory names are interned, so each directory costs a few bytes
+ * instead of a full Akonadi::Collection. Root nodes carry the absolute
+ * path of the notes directory as their name.
+ */
+class CollectionTree
+{
+  public:
+    CollectionTree();
+
+    void clear();
+
+    int addRoot( const QString &path );
+    int addNode( int parent, const QString &name );
+    void renameNode( int node, const QString &name );
+    void moveNode( int node, int parent );
+    void removeNode( int node );
+
+    int find( const QString &path ) const;
+    QList<int> children( int node ) const;
+
+    bool isRoot( int node ) const;
+    int parent( int node ) const;
+    QString name( int node ) const;
+
+    int count() const;
+    int memoryUsage() const;
+
+  private:
+    struct Node
+    {
+      int parent; // -1 for roots, -2 for removed nodes
+      int name;   // index into mNames
+    };
+
+    static quint64 childKey( int parent, int name );
+    int internName( const QString &name );
+
+    QVector<Node> mNodes;
+    QVector<int> mRoots;
+    QVector<QString> mNames;
+    QHash<QString, int> mNameIds;
+    QHash<quint64, int> mChildren; // (parent, name) -> node
+};
+
+#endif
@@ -0,0 +1,8 @@
+/* Define to 1 if you have the copy_file_range function */
+#cmakedefine HAVE_COPY_FILE_RANGE 1
+
+/* Define to 1 if struct stat has nanosecond timestamps in st_mtim (POSIX 2008) */
+#cmakedefine HAVE_STRUCT_STAT_ST_MTIM 1
+
+/* Define to 1 if struct stat has nanosecond timestamps in st_mtimespec (BSD, Mac OS X) */
+#cmakedefine HAVE_STRUCT_STAT_ST_MTIMESPEC 1
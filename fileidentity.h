@@ -0,0 +1,45 @@
+#ifndef FILEIDENTITY_H
+#define FILEIDENTITY_H
+
+#include <QFile>
+#include <QHash>
+#include <QString>
+
+#include <kde_file.h>
+
+/**
+ * Identifies a file by device and inode, so it can be recognized
+ * again after it has been renamed or moved on the same filesystem.
+ */
+struct FileIdentity
+{
+  FileIdentity() : device( 0 ), inode( 0 ) {}
+  FileIdentity( quint64 dev, quint64 ino ) : device( dev ), inode( ino ) {}
+
+  static FileIdentity forPath( const QString &path )
+  {
+    KDE_struct_stat buf;
+
+    if ( KDE::stat( path, &buf ) != 0 )
+      return FileIdentity();
+
+    return FileIdentity( buf.st_dev, buf.st_ino );
+  }
+
+  bool isValid() const { return inode != 0; }
+
+  bool operator==( const FileIdentity &other ) const
+  {
+    return device == other.device && inode == other.inode;
+  }
+
+  quint64 device;
+  quint64 inode;
+};
+
+inline uint qHash( const FileIdentity &id )
+{
+  return qHash( id.inode ) ^ qHash( id.device );
+}
+
+#endif
@@ -0,0 +1,295 @@
+#include "jobdispatcher.h"
+
+#include <Akonadi/CollectionFetchJob>
+#include <Akonadi/ItemFetchJob>
+#include <Akonadi/ItemFetchScope>
+#include <Akonadi/ItemModifyJob>
+#include <Akonadi/ItemMoveJob>
+
+#include <KDebug>
+
+#define DISPATCHER_QUEUE_LIMIT 1000 // Queued collections and items at which producers should hold back
+
+using namespace Akonadi;
+
+JobDispatcher::JobDispatcher( QObject *parent )
+  : QObject( parent ),
+  mMaxRunningJobs( 4 ),
+  mQueueDepth( 0 ),
+  mPeakQueueDepth( 0 ),
+  mFinishedJobs( 0 ),
+  mStartScheduled( false ),
+  mCongested( false )
+{
+}
+
+JobDispatcher::~JobDispatcher()
+{
+  qDeleteAll( mQueue );
+  qDeleteAll( mRunning );
+}
+
+void JobDispatcher::setMaxRunningJobs( int count )
+{
+  mMaxRunningJobs = qMax( 1, count );
+  startJobs();
+}
+
+void JobDispatcher::fetchCollection( const Collection &collection )
+{
+  Request *request = new Request;
+  request->type = Request::FetchCollection;
+  request->collection = collection;
+
+  enqueue( request, 1 );
+}
+
+void JobDispatcher::fetchItem( const Item &item )
+{
+  const QString key = collectionKey( item.parentCollection() );
+
+  // Join a fetch for the same collection which did not start yet
+  Request *request = mQueuedFetches.value( key );
+  if ( request ) {
+    request->items << item;
+    ++mQueueDepth;
+    mPeakQueueDepth = qMax( mPeakQueueDepth, mQueueDepth );
+    mCongested = mCongested || isCongested();
+    return;
+  }
+
+  request = new Request;
+  request->type = Request::FetchItems;
+  request->collection = item.parentCollection();
+  request->items << item;
+
+  mQueuedFetches.insert( key, request );
+  enqueue( request, 1 );
+}
+
+void JobDispatcher::modifyItem( const Item &item )
+{
+  // Only the latest state of an item needs to be written
+  Request *request = mQueuedModifications.value( item.id() );
+  if ( request ) {
+    request->items.first() = item;
+    return;
+  }
+
+  request = new Request;
+  request->type = Request::ModifyItem;
+  request->items << item;
+
+  mQueuedModifications.insert( item.id(), request );
+  enqueue( request, 1 );
+}
+
+void JobDispatcher::renameItem( const Item &item, const Collection &targetCollection, const QString &targetRemoteId )
+{
+  Request *request = new Request;
+  request->type = Request::FetchRenamedItem;
+  request->collection = targetCollection;
+  request->items << item;
+  request->remoteId = targetRemoteId;
+
+  enqueue( request, 1 );
+}
+
+bool JobDispatcher::isCongested() const
+{
+  return mQueueDepth >= DISPATCHER_QUEUE_LIMIT;
+}
+
+int JobDispatcher::queueDepth() const
+{
+  return mQueueDepth;
+}
+
+int JobDispatcher::peakQueueDepth() const
+{
+  return mPeakQueueDepth;
+}
+
+int JobDispatcher::runningJobs() const
+{
+  return mRunning.count();
+}
+
+qlonglong JobDispatcher::finishedJobs() const
+{
+  return mFinishedJobs;
+}
+
+void JobDispatcher::enqueue( Request *request, int entities )
+{
+  mQueue.append( request );
+
+  mQueueDepth += entities;
+  mPeakQueueDepth = qMax( mPeakQueueDepth, mQueueDepth );
+  mCongested = mCongested || isCongested();
+
+  // Start from the event loop, so that requests issued together can be batched
+  if ( !mStartScheduled ) {
+    mStartScheduled = true;
+    QMetaObject::invokeMethod( this, "startJobs", Qt::QueuedConnection );
+  }
+}
+
+void JobDispatcher::startJobs()
+{
+  mStartScheduled = false;
+
+  while ( mRunning.count() < mMaxRunningJobs && !mQueue.isEmpty() ) {
+    Request *request = mQueue.takeFirst();
+
+    switch ( request->type ) {
+      case Request::FetchCollection:
+        mQueueDepth -= 1;
+        startJob( new CollectionFetchJob( request->collection, CollectionFetchJob::Base, this ), request );
+        break;
+
+      case Request::FetchItems:
+        mQueuedFetches.remove( collectionKey( request->collection ) );
+        mQueueDepth -= request->items.count();
+
+        if ( request->items.count() == 1 ) {
+          startFetchItems( request, Collection() );
+        } else {
+          // Remote ids are only unique per collection, so its id is needed to fetch several at once
+          startJob( new CollectionFetchJob( request->collection, CollectionFetchJob::Base, this ), request );
+        }
+        break;
+
+      case Request::ModifyItem:
+        mQueuedModifications.remove( request->items.first().id() );
+        mQueueDepth -= 1;
+        startJob( new ItemModifyJob( request->items.first(), this ), request );
+        break;
+
+      case Request::FetchRenamedItem:
+        mQueueDepth -= 1;
+        startJob( new ItemFetchJob( request->items.first(), this ), request );
+        break;
+
+      case Request::MoveRenamedItem:
+        // The target collection is only known by its remote id, resolve it first
+        mQueueDepth -= 1;
+        startJob( new CollectionFetchJob( request->collection, CollectionFetchJob::Base, this ), request );
+        break;
+
+      case Request::ModifyRemoteId: {
+        mQueueDepth -= 1;
+
+        Item item( request->items.first().id() );
+        item.setRemoteId( request->remoteId );
+
+        ItemModifyJob *job = new ItemModifyJob( item, this );
+        job->setIgnorePayload( true );
+        job->disableRevisionCheck();
+        startJob( job, request );
+        break;
+      }
+    }
+  }
+
+  if ( mCongested && mQueueDepth <= DISPATCHER_QUEUE_LIMIT / 2 ) {
+    mCongested = false;
+    emit drained();
+  }
+}
+
+void JobDispatcher::startFetchItems( Request *request, const Collection &resolvedCollection )
+{
+  ItemFetchJob *job = request->items.count() == 1 ? new ItemFetchJob( request->items.first(), this )
+                                                  : new ItemFetchJob( request->items, this );
+
+  if ( resolvedCollection.isValid() )
+    job->setCollection( resolvedCollection );
+
+  job->fetchScope().setAncestorRetrieval( ItemFetchScope::All );
+
+  startJob( job, request );
+}
+
+void JobDispatcher::startJob( KJob *job, Request *request )
+{
+  mRunning.insert( job, request );
+  connect( job, SIGNAL(result(KJob*)), SLOT(jobFinished(KJob*)) );
+}
+
+void JobDispatcher::jobFinished( KJob *job )
+{
+  Request *request = mRunning.take( job );
+  ++mFinishedJobs;
+
+  if ( job->error() ) {
+    kDebug() << job->errorString();
+
+    if ( request->type == Request::FetchRenamedItem || request->type == Request::MoveRenamedItem
+         || request->type == Request::ModifyRemoteId )
+      emit itemRenamed( false );
+  } else if ( request->type == Request::FetchCollection ) {
+    const Collection::List cols = qobject_cast<CollectionFetchJob*>( job )->collections();
+    if ( !cols.isEmpty() )
+      emit collectionFetched( cols.first() );
+  } else if ( request->type == Request::FetchItems ) {
+    if ( CollectionFetchJob *fetchJob = qobject_cast<CollectionFetchJob*>( job ) ) {
+      if ( !fetchJob->collections().isEmpty() ) {
+        startFetchItems( request, fetchJob->collections().first() ); // Keeps its slot
+        return;
+      }
+    } else {
+      emit itemsFetched( qobject_cast<ItemFetchJob*>( job )->items() );
+    }
+  } else if ( request->type == Request::FetchRenamedItem ) {
+    const Item::List items = qobject_cast<ItemFetchJob*>( job )->items();
+
+    if ( !items.isEmpty() ) {
+      // Renamed in place only needs a new remote id, otherwise the item is moved first
+      const bool sameCollection = collectionKey( request->items.first().parentCollection() ) == collectionKey( request->collection );
+
+      request->type = sameCollection ? Request::ModifyRemoteId : Request::MoveRenamedItem;
+      request->items = items;
+      enqueue( request, 1 );
+      startJobs();
+      return;
+    }
+
+    emit itemRenamed( false );
+  } else if ( request->type == Request::MoveRenamedItem ) {
+    if ( CollectionFetchJob *fetchJob = qobject_cast<CollectionFetchJob*>( job ) ) {
+      if ( !fetchJob->collections().isEmpty() ) {
+        startJob( new ItemMoveJob( request->items.first(), fetchJob->collections().first(), this ), request ); // Keeps its slot
+        return;
+      }
+
+      emit itemRenamed( false );
+    } else {
+      // The item keeps its remote id on move, so update it if the file was renamed as well
+      request->type = Request::ModifyRemoteId;
+      enqueue( request, 1 );
+      startJobs();
+      return;
+    }
+  } else if ( request->type == Request::ModifyRemoteId ) {
+    emit itemRenamed( true );
+  }
+
+  delete request;
+  startJobs();
+}
+
+QString JobDispatcher::collectionKey( const Collection &collection )
+{
+  QString key;
+
+  for ( Collection col = collection; col.isValid() || !col.remoteId().isEmpty(); col = col.parentCollection() ) {
+    if ( col == Collection::root() )
+      break;
+    key.prepend( col.remoteId() + QLatin1Char( '/' ) );
+  }
+
+  return key;
+}
+
+#include "jobdispatcher.moc"
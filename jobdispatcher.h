@@ -0,0 +1,87 @@
+#ifndef JOBDISPATCHER_H
+#define JOBDISPATCHER_H
+
+#include <Akonadi/Collection>
+#include <Akonadi/Item>
+
+#include <QHash>
+#include <QList>
+#include <QObject>
+
+class KJob;
+
+/**
+ * Runs the Akonadi jobs triggered by file system changes with bounded concurrency.
+ *
+ * Item fetches for the same collection which are queued at the same time are
+ * merged into a single job, queued modifications of the same item are replaced
+ * by the latest one. Renames of items go through it as a chain of requests
+ * (fetch, optional move, remote id update), one queued step at a time.
+ * Once too much work is queued, isCongested() tells the producer to hold back
+ * until drained() is emitted.
+ */
+class JobDispatcher : public QObject
+{
+  Q_OBJECT
+  Q_CLASSINFO( "D-Bus Interface", "org.kde.Akonadi.PlainNotes.JobDispatcher" )
+
+  public:
+    explicit JobDispatcher( QObject *parent = 0 );
+    ~JobDispatcher();
+
+    void setMaxRunningJobs( int count );
+
+    void fetchCollection( const Akonadi::Collection &collection );
+    void fetchItem( const Akonadi::Item &item );
+    void modifyItem( const Akonadi::Item &item );
+    void renameItem( const Akonadi::Item &item, const Akonadi::Collection &targetCollection, const QString &targetRemoteId );
+
+    bool isCongested() const;
+
+  Q_SIGNALS:
+    void collectionFetched( const Akonadi::Collection &collection );
+    void itemsFetched( const Akonadi::Item::List &items );
+    void itemRenamed( bool success );
+    void drained();
+
+  public Q_SLOTS:
+    Q_SCRIPTABLE int queueDepth() const;
+    Q_SCRIPTABLE int peakQueueDepth() const;
+    Q_SCRIPTABLE int runningJobs() const;
+    Q_SCRIPTABLE qlonglong finishedJobs() const;
+
+  private Q_SLOTS:
+    void startJobs();
+    void jobFinished( KJob *job );
+
+  private:
+    struct Request
+    {
+      enum Type { FetchCollection, FetchItems, ModifyItem, FetchRenamedItem, MoveRenamedItem, ModifyRemoteId };
+
+      Type type;
+      Akonadi::Collection collection; // Target collection for the rename steps
+      Akonadi::Item::List items;
+      QString remoteId;               // Target remote id for the rename steps
+    };
+
+    static QString collectionKey( const Akonadi::Collection &collection );
+
+    void enqueue( Request *request, int entities );
+    void startFetchItems( Request *request, const Akonadi::Collection &resolvedCollection );
+    void startJob( KJob *job, Request *request );
+
+    QList<Request*> mQueue;
+    QHash<QString, Request*> mQueuedFetches;         // Collection key -> queued item fetch, for batching
+    QHash<Akonadi::Item::Id, Request*> mQueuedModifications;
+    QHash<KJob*, Request*> mRunning;
+
+    int mMaxRunningJobs;
+    int mQueueDepth;   // Queued collections and items, not requests
+    int mPeakQueueDepth;
+    qlonglong mFinishedJobs;
+    bool mStartScheduled;
+    bool mCongested;
+};
+
+#endif
@@ -0,0 +1,174 @@
+#include "notemetadataattribute.h"
+
+#include <QDataStream>
+#include <QFile>
+#include <QTextStream>
+
+#define METADATA_READ_LIMIT 4096 // Metadata has to be within the first characters of a note
+#define METADATA_TITLE_LIMIT 256
+
+NoteMetadataAttribute::NoteMetadataAttribute()
+{
+}
+
+QString NoteMetadataAttribute::title() const
+{
+  return mTitle;
+}
+
+void NoteMetadataAttribute::setTitle( const QString &title )
+{
+  mTitle = title;
+}
+
+QStringList NoteMetadataAttribute::tags() const
+{
+  return mTags;
+}
+
+void NoteMetadataAttribute::setTags( const QStringList &tags )
+{
+  mTags = tags;
+}
+
+bool NoteMetadataAttribute::isEmpty() const
+{
+  return mTitle.isEmpty() && mTags.isEmpty();
+}
+
+QByteArray NoteMetadataAttribute::type() const
+{
+  return "NoteMetadata";
+}
+
+Akonadi::Attribute *NoteMetadataAttribute::clone() const
+{
+  NoteMetadataAttribute *attr = new NoteMetadataAttribute;
+  attr->mTitle = mTitle;
+  attr->mTags = mTags;
+
+  return attr;
+}
+
+QByteArray NoteMetadataAttribute::serialized() const
+{
+  // Neither titles nor tags can span lines, see fromText()
+  return ( QStringList( mTitle ) + mTags ).join( QLatin1String( "\n" ) ).toUtf8();
+}
+
+void NoteMetadataAttribute::deserialize( const QByteArray &data )
+{
+  // Attributes written by earlier versions are a QDataStream, which starts with a string length
+  if ( data.startsWith( '\0' ) || data.startsWith( '\xff' ) ) {
+    QDataStream stream( data );
+    stream.setVersion( QDataStream::Qt_4_5 );
+    stream >> mTitle >> mTags;
+    return;
+  }
+
+  mTags = QString::fromUtf8( data ).split( QLatin1Char( '\n' ) );
+  mTitle = mTags.takeFirst();
+  mTags.removeAll( QString() );
+}
+
+NoteMetadataAttribute *NoteMetadataAttribute::fromFile( const QString &filePath )
+{
+  QFile file( filePath );
+
+  if ( !file.open( QIODevice::ReadOnly ) )
+    return new NoteMetadataAttribute;
+
+  // Decoded like the payload, reading characters so a multibyte sequence is never cut in half
+  QTextStream stream( &file );
+  return fromText( stream.read( METADATA_READ_LIMIT ) );
+}
+
+static QString unquoted( const QString &value )
+{
+  const QString v = value.trimmed();
+
+  if ( v.length() >= 2 && ( ( v.startsWith( QLatin1Char( '"' ) ) && v.endsWith( QLatin1Char( '"' ) ) )
+                            || ( v.startsWith( QLatin1Char( '\'' ) ) && v.endsWith( QLatin1Char( '\'' ) ) ) ) )
+    return v.mid( 1, v.length() - 2 );
+
+  return v;
+}
+
+NoteMetadataAttribute *NoteMetadataAttribute::fromText( const QString &text )
+{
+  NoteMetadataAttribute *attr = new NoteMetadataAttribute;
+
+  // Only look at the same leading part a file read would have returned
+  const QStringList lines = text.left( METADATA_READ_LIMIT ).split( QLatin1Char( '\n' ) );
+
+  if ( !lines.isEmpty() && lines.first().trimmed() == QLatin1String( "---" ) ) {
+    QString title;
+    QStringList tags;
+    QString listKey;
+
+    for ( int i = 1; i < lines.count(); ++i ) {
+      const QString line = lines.at( i );
+      const QString trimmed = line.trimmed();
+
+      if ( trimmed == QLatin1String( "---" ) || trimmed == QLatin1String( "..." ) ) { // End of front-matter
+        attr->mTitle = title.left( METADATA_TITLE_LIMIT );
+        attr->mTags = tags;
+        return attr;
+      }
+
+      // Block list item belonging to the last key, e.g. "  - tag"
+      if ( trimmed.startsWith( QLatin1String( "- " ) ) ) {
+        if ( listKey == QLatin1String( "tags" ) )
+          tags << unquoted( trimmed.mid( 2 ) );
+        continue;
+      }
+
+      const int colon = line.indexOf( QLatin1Char( ':' ) );
+      if ( colon <= 0 || line.at( 0 ).isSpace() ) {
+        listKey.clear();
+        continue;
+      }
+
+      QString key = line.left( colon ).trimmed().toLower();
+      const QString value = line.mid( colon + 1 ).trimmed();
+
+      if ( key == QLatin1String( "tag" ) || key == QLatin1String( "keywords" ) )
+        key = QLatin1String( "tags" );
+
+      listKey = value.isEmpty() ? key : QString();
+
+      if ( key == QLatin1String( "title" ) ) {
+        title = unquoted( value );
+      } else if ( key == QLatin1String( "tags" ) && !value.isEmpty() ) {
+        // Flow list "[a, b]" or plain "a, b"
+        QString list = value;
+        if ( list.startsWith( QLatin1Char( '[' ) ) && list.endsWith( QLatin1Char( ']' ) ) )
+          list = list.mid( 1, list.length() - 2 );
+
+        foreach ( const QString &tag, list.split( QLatin1Char( ',' ), QString::SkipEmptyParts ) ) {
+          if ( !unquoted( tag ).isEmpty() )
+            tags << unquoted( tag );
+        }
+      }
+    }
+
+    return attr; // Unterminated within the read limit, don't trust anything of it
+  }
+
+  // No front-matter, the first non-empty line is the title (without markdown heading marks)
+  foreach ( const QString &line, lines ) {
+    QString title = line.trimmed();
+
+    while ( title.startsWith( QLatin1Char( '#' ) ) )
+      title.remove( 0, 1 );
+
+    title = title.trimmed();
+
+    if ( !title.isEmpty() ) {
+      attr->mTitle = title.left( METADATA_TITLE_LIMIT );
+      break;
+    }
+  }
+
+  return attr;
+}
@@ -0,0 +1,43 @@
+#ifndef NOTEMETADATAATTRIBUTE_H
+#define NOTEMETADATAATTRIBUTE_H
+
+#include <Akonadi/Attribute>
+
+#include <QStringList>
+
+/**
+ * Title and tags of a note, taken from its YAML front-matter or, if
+ * there is none, from its first line.
+ *
+ * Stored with the item, so clients can sort and filter notes without
+ * fetching their payload. Clients don't need this class for that, the
+ * "NoteMetadata" attribute is plain UTF-8 text: the title on the first
+ * line, followed by one tag per line.
+ */
+class NoteMetadataAttribute : public Akonadi::Attribute
+{
+  public:
+    NoteMetadataAttribute();
+
+    QString title() const;
+    void setTitle( const QString &title );
+
+    QStringList tags() const;
+    void setTags( const QStringList &tags );
+
+    bool isEmpty() const;
+
+    virtual QByteArray type() const;
+    virtual Akonadi::Attribute *clone() const;
+    virtual QByteArray serialized() const;
+    virtual void deserialize( const QByteArray &data );
+
+    static NoteMetadataAttribute *fromFile( const QString &filePath );
+    static NoteMetadataAttribute *fromText( const QString &text );
+
+  private:
+    QString mTitle;
+    QStringList mTags;
+};
+
+#endif
@@ -0,0 +1,107 @@
+#include "payloadcache.h"
+
+#include <config-plainnotes.h>
+
+PayloadCache::PayloadCache( QObject *parent )
+  : QObject( parent ),
+  mHits( 0 ),
+  mMisses( 0 )
+{
+}
+
+KMime::Message::Ptr PayloadCache::find( const QString &filePath, NoteMetadataAttribute **metadata )
+{
+  Entry *entry = mEntries.object( filePath );
+
+  if ( entry ) {
+    if ( fileState( filePath ) == entry->state ) {
+      ++mHits;
+
+      // The caller owns the copy, as it usually hands it over to an item
+      if ( metadata )
+        *metadata = entry->metadata ? static_cast<NoteMetadataAttribute*>( entry->metadata->clone() ) : new NoteMetadataAttribute;
+
+      return entry->payload;
+    }
+
+    mEntries.remove( filePath ); // Changed on disk behind our back
+  }
+
+  ++mMisses;
+  return KMime::Message::Ptr();
+}
+
+void PayloadCache::insert( const QString &filePath, const KMime::Message::Ptr &payload, const FileState &state,
+                           const NoteMetadataAttribute *metadata )
+{
+  // The state has to be taken before reading, so that a write racing with the read invalidates the entry
+  if ( !payload || !state.isValid() )
+    return;
+
+  Entry *entry = new Entry;
+  entry->state = state;
+  entry->payload = payload;
+  entry->metadata = metadata ? static_cast<NoteMetadataAttribute*>( metadata->clone() ) : 0;
+
+  // QCache takes ownership and drops the entry right away if it is bigger than the whole cache
+  mEntries.insert( filePath, entry, payload->encodedContent().size() );
+}
+
+void PayloadCache::invalidate( const QString &filePath )
+{
+  mEntries.remove( filePath );
+}
+
+void PayloadCache::clear()
+{
+  mEntries.clear();
+}
+
+void PayloadCache::setMaxSize( int bytes )
+{
+  mEntries.setMaxCost( bytes );
+}
+
+qlonglong PayloadCache::hits() const
+{
+  return mHits;
+}
+
+qlonglong PayloadCache::misses() const
+{
+  return mMisses;
+}
+
+int PayloadCache::size() const
+{
+  return mEntries.totalCost();
+}
+
+int PayloadCache::count() const
+{
+  return mEntries.count();
+}
+
+PayloadCache::FileState PayloadCache::fileState( const QString &filePath )
+{
+  FileState state;
+  KDE_struct_stat buf;
+
+  if ( KDE::stat( filePath, &buf ) != 0 )
+    return state;
+
+  // Seconds alone would let a same-size rewrite within one second pass as unchanged
+  state.id = FileIdentity( buf.st_dev, buf.st_ino );
+  state.size = buf.st_size;
+#if defined(HAVE_STRUCT_STAT_ST_MTIM)
+  state.lastModified = qint64( buf.st_mtim.tv_sec ) * 1000000000 + buf.st_mtim.tv_nsec;
+#elif defined(HAVE_STRUCT_STAT_ST_MTIMESPEC)
+  state.lastModified = qint64( buf.st_mtimespec.tv_sec ) * 1000000000 + buf.st_mtimespec.tv_nsec;
+#else
+  state.lastModified = qint64( buf.st_mtime ) * 1000000000;
+#endif
+
+  return state;
+}
+
+#include "payloadcache.moc"
@@ -0,0 +1,74 @@
+#ifndef PAYLOADCACHE_H
+#define PAYLOADCACHE_H
+
+#include "fileidentity.h"
+#include "notemetadataattribute.h"
+
+#include <KMime/KMimeMessage>
+
+#include <QCache>
+#include <QObject>
+
+/**
+ * Size bounded LRU cache of assembled note payloads, keyed by file path.
+ *
+ * Entries remember inode, size and modification time of the file they were
+ * read from and are dropped as soon as the file on disk does not match anymore.
+ * The note's metadata attribute is kept along, so a hit needs no parsing.
+ */
+class PayloadCache : public QObject
+{
+  Q_OBJECT
+  Q_CLASSINFO( "D-Bus Interface", "org.kde.Akonadi.PlainNotes.PayloadCache" )
+
+  public:
+    struct FileState
+    {
+      FileState() : size( -1 ), lastModified( 0 ) {}
+
+      bool isValid() const { return id.isValid(); }
+      bool operator==( const FileState &other ) const
+      {
+        return id == other.id && size == other.size && lastModified == other.lastModified;
+      }
+
+      FileIdentity id;
+      qint64 size;
+      qint64 lastModified; // in nanoseconds
+    };
+
+    explicit PayloadCache( QObject *parent = 0 );
+
+    static FileState fileState( const QString &filePath );
+
+    KMime::Message::Ptr find( const QString &filePath, NoteMetadataAttribute **metadata = 0 );
+    void insert( const QString &filePath, const KMime::Message::Ptr &payload, const FileState &state,
+                 const NoteMetadataAttribute *metadata = 0 );
+    void invalidate( const QString &filePath );
+    void clear();
+
+    void setMaxSize( int bytes );
+
+  public Q_SLOTS:
+    Q_SCRIPTABLE qlonglong hits() const;
+    Q_SCRIPTABLE qlonglong misses() const;
+    Q_SCRIPTABLE int size() const;
+    Q_SCRIPTABLE int count() const;
+
+  private:
+    struct Entry
+    {
+      Entry() : metadata( 0 ) {}
+      ~Entry() { delete metadata; }
+
+      FileState state;
+      KMime::Message::Ptr payload;
+      NoteMetadataAttribute *metadata;
+    };
+
+    QCache<QString, Entry> mEntries;
+    qlonglong mHits;
+    qlonglong mMisses;
+};
+
+#endif
@@ -1,34 +1,58 @@
 #include "plainnotesresource.h"
 
+#include "jobdispatcher.h"
+#include "notemetadataattribute.h"
+#include "payloadcache.h"
 #include "settings.h"
 #include "settingsadaptor.h"
 #include "settingsdialog.h"
+#include "treeoperation.h"
 
 #include <QtDBus/QDBusConnection>
+#include <QtCore/QDateTime>
+#include <QtCore/QDirIterator>
+#include <QtCore/QTimer>
 
+#include <Akonadi/AttributeFactory>
 #include <Akonadi/ChangeRecorder>
 #include <Akonadi/ItemFetchScope>
-#include <Akonadi/ItemFetchJob>
-#include <Akonadi/ItemModifyJob>
 #include <Akonadi/CollectionFetchScope>
-#include <Akonadi/CollectionFetchJob>
 
 #include <KLocale>
 #include <KDirWatch>
+#include <KProcess>
 #include <KMime/KMimeMessage>
 
 #define ENCODING "utf-8"
 #define X_NOTES_LASTMODIFIED_HEADER "X-Akonotes-LastModified"
+#define ITEM_CHUNK_SIZE 1000 // Number of items delivered to Akonadi at once when listing a directory
+#define DIRTY_DIRECTORIES_DELAY 500 // Time to collect related watcher events (e.g. both sides of a move), in ms
+#define WRITE_COALESCING_DELAY 1000 // Maximum time a changed note body is kept in memory before written to disk, in ms
+#define GIT_LOCK_TIMEOUT 120 // Age after which a git index lock is considered left over from a crashed git, in s
 
 using namespace Akonadi;
 
 PlainNotesResource::PlainNotesResource( const QString &id )
   : ResourceBase( id ),
   mSettings( new PlainNotesResourceSettings() ),
-  mFsWatcher( new KDirWatch( this ) )
+  mFsWatcher( new KDirWatch( this ) ),
+  mItemScanner( 0 ),
+  mPayloadCache( new PayloadCache( this ) ),
+  mDispatcher( new JobDispatcher( this ) ),
+  mDirtyTimer( new QTimer( this ) ),
+  mPendingRenames( 0 ),
+  mWriteTimer( new QTimer( this ) ),
+  mWritesFailing( false ),
+  mCollectionTreeDirty( false )
 {
   new PlainNotesResourceSettingsAdaptor( mSettings );
   QDBusConnection::sessionBus().registerObject( QLatin1String( "/Settings" ), mSettings, QDBusConnection::ExportAdaptors );
+  QDBusConnection::sessionBus().registerObject( QLatin1String( "/PayloadCache" ), mPayloadCache, QDBusConnection::ExportScriptableSlots );
+
+  QDBusConnection::sessionBus().registerObject( QLatin1String( "/JobDispatcher" ), mDispatcher, QDBusConnection::ExportScriptableSlots );
+
+  mPayloadCache->setMaxSize( mSettings->payloadCacheSize() );
+  mDispatcher->setMaxRunningJobs( mSettings->maxConcurrentJobs() );
 
   changeRecorder()->fetchCollection( true );
   changeRecorder()->itemFetchScope().fetchFullPayload( true );
@@ -37,36 +61,50 @@ PlainNotesResource::PlainNotesResource( const QString &id )
 
   setHierarchicalRemoteIdentifiersEnabled( true );
 
+  AttributeFactory::registerAttribute<NoteMetadataAttribute>();
+
   mItemMimeType = QLatin1String( "text/x-vnd.akonadi.note" );
   mSupportedMimeTypes << Collection::mimeType() << mItemMimeType;
 
-  initializeDirectory( baseDirectoryPath() );
+  foreach ( const QString &path, baseDirectoryPaths() )
+    initializeDirectory( path );
+
+  mDirtyTimer->setSingleShot( true );
+  mDirtyTimer->setInterval( DIRTY_DIRECTORIES_DELAY );
+
+  mWriteTimer->setSingleShot( true );
+  mWriteTimer->setInterval( WRITE_COALESCING_DELAY );
 
   connect( mFsWatcher, SIGNAL(dirty(QString)), SLOT(directoryChanged(QString)) );
+  connect( mDirtyTimer, SIGNAL(timeout()), SLOT(processDirtyPaths()) );
+  connect( mWriteTimer, SIGNAL(timeout()), SLOT(flushPendingWrites()) );
+  connect( mDispatcher, SIGNAL(collectionFetched(Akonadi::Collection)), SLOT(fsWatchCollectionFetched(Akonadi::Collection)) );
+  connect( mDispatcher, SIGNAL(itemsFetched(Akonadi::Item::List)), SLOT(fsWatchItemsFetched(Akonadi::Item::List)) );
+  connect( mDispatcher, SIGNAL(itemRenamed(bool)), SLOT(renameFinished()) );
+  connect( mDispatcher, SIGNAL(drained()), mDirtyTimer, SLOT(start()) );
+
+  updateGitWatching();
 
   synchronizeCollectionTree();
 }
 
 PlainNotesResource::~PlainNotesResource()
 {
+  delete mItemScanner;
 }
 
 void PlainNotesResource::retrieveCollections()
 {
-  // create the resource collection
-  Collection resourceCollection;
-  resourceCollection.setParentCollection( Collection::root() );
-  resourceCollection.setRemoteId( baseDirectoryPath() );
-  resourceCollection.setName( name() );
-  resourceCollection.setContentMimeTypes( mSupportedMimeTypes );
-  resourceCollection.setRights( supportedRights( true ) );
+  mCollectionTree.clear();
+  mCollectionTreeDirty = false;
 
-  const QDir baseDir( baseDirectoryPath() );
+  foreach ( const QString &path, baseDirectoryPaths() )
+    buildCollectionTree( QDir( path ), mCollectionTree.addRoot( path ) );
 
-  Collection::List collections = createCollectionsForDirectory( baseDir, resourceCollection );
-  collections.append( resourceCollection );
+  kDebug() << "Collection tree has" << mCollectionTree.count() << "nodes,"
+           << mCollectionTree.memoryUsage() / mCollectionTree.count() << "bytes per node";
 
-  collectionsRetrieved( collections );
+  collectionsRetrieved( collectionsForTree() );
 }
 
 void PlainNotesResource::retrieveItems( const Akonadi::Collection &collection )
@@ -78,24 +116,60 @@ void PlainNotesResource::retrieveItems( const Akonadi::Collection &collection )
     return;
   }
 
-  directory.setFilter( QDir::Files | QDir::Readable );
+  delete mItemScanner;
+  mItemScanner = new QDirIterator( directory.path(), QDir::Files | QDir::Readable );
+
+  // Streaming needs no total, so the first notes are delivered without scanning the directory twice
+  setItemStreamingEnabled( true );
+
+  // Deliver items in chunks from the event loop, so huge directories neither block nor pile up in memory
+  QMetaObject::invokeMethod( this, "retrieveNextItemChunk", Qt::QueuedConnection );
+}
+
+void PlainNotesResource::retrieveNextItemChunk()
+{
+  if ( !mItemScanner )
+    return;
 
   Item::List items;
+  items.reserve( ITEM_CHUNK_SIZE );
 
-  const QFileInfoList entries = directory.entryInfoList();
+  while ( items.count() < ITEM_CHUNK_SIZE && mItemScanner->hasNext() ) {
+    mItemScanner->next();
+
+    const QFileInfo entry = mItemScanner->fileInfo();
 
-  foreach ( const QFileInfo &entry, entries ) {
     if ( isIgnored( entry.fileName() ) )
       continue;
 
+    KnownFile *known = rememberFile( entry );
+
     Item item;
     item.setRemoteId( entry.fileName() );
     item.setMimeType( mItemMimeType );
 
+    // Notes unchanged since they were last listed keep their stored attribute, only new or modified ones are read
+    if ( !known || !known->metadataKnown ) {
+      setItemMetadata( item, NoteMetadataAttribute::fromFile( entry.filePath() ) ); // Reads only the beginning of the file
+
+      if ( known )
+        known->metadataKnown = true;
+    }
+
     items.append( item );
   }
 
   itemsRetrieved( items );
+
+  if ( mItemScanner->hasNext() ) {
+    QMetaObject::invokeMethod( this, "retrieveNextItemChunk", Qt::QueuedConnection );
+    return;
+  }
+
+  delete mItemScanner;
+  mItemScanner = 0;
+
+  itemsRetrievalDone();
 }
 
 bool PlainNotesResource::retrieveItem( const Akonadi::Item &item, const QSet<QByteArray> &parts )
@@ -104,6 +178,22 @@ bool PlainNotesResource::retrieveItem( const Akonadi::Item &item, const QSet<QBy
 
   const QString filePath = directoryForCollection( item.parentCollection() ) + QDir::separator() + item.remoteId();
 
+  flushPendingWrites();
+
+  Item newItem( item );
+  newItem.setMimeType( mItemMimeType );
+
+  NoteMetadataAttribute *cachedMetadata = 0;
+  const KMime::Message::Ptr cached = mPayloadCache->find( filePath, &cachedMetadata );
+  if ( cached ) {
+    newItem.setPayload( cached );
+    setItemMetadata( newItem, cachedMetadata );
+    itemRetrieved( newItem );
+    return true;
+  }
+
+  const PayloadCache::FileState fileState = PayloadCache::fileState( filePath );
+
   QFile file( filePath );
 
   if ( !file.open( QIODevice::ReadOnly ) ) {
@@ -115,10 +205,9 @@ bool PlainNotesResource::retrieveItem( const Akonadi::Item &item, const QSet<QBy
 
   file.close();
 
-  Item newItem( item );
-  newItem.setMimeType( mItemMimeType );
-
   setItemPayload( newItem, filePath, data );
+  mPayloadCache->insert( filePath, newItem.payload<KMime::Message::Ptr>(), fileState, newItem.attribute<NoteMetadataAttribute>() );
+
   itemRetrieved( newItem );
 
   return true;
@@ -138,10 +227,24 @@ void PlainNotesResource::setItemPayload( Akonadi::Item & item, QString file, QSt
   msg->assemble();
 
   item.setPayload( KMime::Message::Ptr( msg ) );
+
+  setItemMetadata( item, NoteMetadataAttribute::fromText( data ) );
+}
+
+void PlainNotesResource::setItemMetadata( Akonadi::Item &item, NoteMetadataAttribute *metadata ) const
+{
+  if ( metadata->isEmpty() ) {
+    delete metadata;
+    item.removeAttribute<NoteMetadataAttribute>();
+    return;
+  }
+
+  item.addAttribute( metadata );
 }
 
 void PlainNotesResource::aboutToQuit()
 {
+  flushPendingWrites();
   mSettings->writeConfig();
 }
 
@@ -153,7 +256,14 @@ void PlainNotesResource::configure( WId windowId )
     mSettings->writeConfig();
 
     clearCache();
-    initializeDirectory( baseDirectoryPath() );
+    mPayloadCache->clear();
+    mPayloadCache->setMaxSize( mSettings->payloadCacheSize() );
+    mDispatcher->setMaxRunningJobs( mSettings->maxConcurrentJobs() );
+
+    foreach ( const QString &path, baseDirectoryPaths() )
+      initializeDirectory( path );
+
+    updateGitWatching();
 
     synchronize();
 
@@ -169,6 +279,13 @@ void PlainNotesResource::configure( WId windowId )
 
 void PlainNotesResource::directoryChanged( const QString &dir )
 {
+  foreach ( const QString &root, mGitRoots ) {
+    if ( dir == root + QLatin1String( "/.git/logs/HEAD" ) ) {
+      gitHeadChanged( root );
+      return;
+    }
+  }
+
   QFileInfo fi( dir );
 
   if ( isIgnored( fi.fileName() ) ) {
@@ -183,40 +300,162 @@ void PlainNotesResource::directoryChanged( const QString &dir )
 
   kWarning() << "directory changed" << dir;
 
-  if ( dir == baseDirectoryPath() ) {
-    synchronize();
+  // Collect events for a moment, so that renames and moves between directories can be matched up
+  mDirtyDirectories.insert( dir );
+  mDirtyTimer->start();
+}
+
+void PlainNotesResource::processDirtyPaths()
+{
+  // A git checkout or pull is still writing files below these roots, their paths wait until it is done
+  const QStringList lockedRoots = lockedGitRoots();
+
+  // Too many jobs queued already, continue when the dispatcher has drained
+  if ( mDispatcher->isCongested() )
+    return;
+
+  int heldBackFiles = 0;
+
+  QSet<QString>::iterator it = mDirtyFiles.begin();
+  while ( it != mDirtyFiles.end() && !mDispatcher->isCongested() ) {
+    if ( !lockedRoots.isEmpty() && lockedRoots.contains( rootDirectoryForPath( *it ) ) ) {
+      ++heldBackFiles;
+      ++it;
+      continue;
+    }
+
+    if ( QFileInfo( *it ).isFile() )
+      updateItemForFile( *it );
+
+    it = mDirtyFiles.erase( it );
+  }
+
+  if ( mDirtyFiles.count() > heldBackFiles )
+    return;
+
+  QStringList dirs;
+
+  QSet<QString>::iterator dirIt = mDirtyDirectories.begin();
+  while ( dirIt != mDirtyDirectories.end() ) {
+    if ( !lockedRoots.isEmpty() && lockedRoots.contains( rootDirectoryForPath( *dirIt ) ) ) {
+      ++dirIt;
+      continue;
+    }
+
+    dirs << *dirIt;
+    dirIt = mDirtyDirectories.erase( dirIt );
+  }
+
+  if ( heldBackFiles > 0 || !mDirtyDirectories.isEmpty() )
+    mDirtyTimer->start(); // Check the locks again shortly
+
+  QSet<QString> existingFiles;
+
+  foreach ( const QString &dir, dirs ) {
+    QDir directory( dir );
+    directory.setFilter( QDir::Files | QDir::Readable );
+
+    const QFileInfoList entries = directory.entryInfoList();
+
+    foreach ( const QFileInfo &entry, entries ) {
+      if ( isIgnored( entry.fileName() ) )
+        continue;
+
+      const FileIdentity id = FileIdentity::forPath( entry.filePath() );
+      const QHash<FileIdentity, KnownFile>::const_iterator known = mKnownFiles.constFind( id );
+
+      // Same inode, unchanged content, but old location gone - file was renamed or moved
+      if ( known != mKnownFiles.constEnd() && known->path != entry.filePath() && !QFile::exists( known->path )
+           && known->size == entry.size() && known->lastModified == entry.lastModified().toTime_t() ) {
+        const QString sourcePath = known->path;
+        const FileIdentity overwritten = knownIdentityForPath( entry.filePath() );
+
+        if ( overwritten.isValid() ) {
+          // Moved over another note, which keeps its item and gets the new content, the source item goes away
+          mKnownFiles.remove( overwritten );
+          mKnownFiles.remove( id );
+
+          mPayloadCache->invalidate( entry.filePath() );
+          mDirtyFiles.insert( entry.filePath() );
+          mDirtyDirectories.insert( QFileInfo( sourcePath ).path() );
+          mDirtyTimer->start();
+        } else {
+          renameKnownItem( sourcePath, entry.filePath() );
+        }
+      }
+
+      rememberFile( entry );
+      existingFiles.insert( entry.filePath() );
+    }
+  }
+
+  forgetMissingFiles( dirs, existingFiles );
+
+  // Synchronizing before the renames are applied would report them as removed and added items
+  if ( mPendingRenames > 0 ) {
+    mDirectoriesAwaitingRenames << dirs;
     return;
   }
 
+  foreach ( const QString &dir, dirs )
+    synchronizeDirectory( dir );
+}
+
+void PlainNotesResource::synchronizeDirectory( const QString &dir )
+{
+  // Only the changed root is synchronized, the folders of all roots are rescanned only if some were added or removed
+  if ( baseDirectoryPaths().contains( dir ) && ( mCollectionTreeDirty || subdirectoriesChanged( dir ) ) ) {
+    mCollectionTreeDirty = false;
+    synchronizeCollectionTree();
+  }
+
   const Collection col = collectionForDirectory( dir );
   if ( col.remoteId().isEmpty() ) {
     kWarning() << "Unable to find collection for path" << dir;
     return;
   }
 
-  CollectionFetchJob *job = new CollectionFetchJob( col, CollectionFetchJob::Base, this );
-  connect( job, SIGNAL(result(KJob*)), SLOT(fsWatchDirFetchResult(KJob*)) );
+  mDispatcher->fetchCollection( col );
 }
 
-void PlainNotesResource::fsWatchDirFetchResult(KJob* job)
+bool PlainNotesResource::subdirectoriesChanged( const QString &dir ) const
 {
-  if ( job->error() ) {
-    kDebug() << job->errorString();
-    return;
-  }
+  const int node = mCollectionTree.find( dir );
+  if ( node < 0 )
+    return true;
 
-  const Collection::List cols = qobject_cast<CollectionFetchJob*>( job )->collections();
+  QSet<QString> knownNames;
+  foreach ( int child, mCollectionTree.children( node ) )
+    knownNames.insert( mCollectionTree.name( child ) );
 
-  if ( cols.isEmpty() )
-    return;
+  QDir directory( dir );
+  directory.setFilter( QDir::Dirs | QDir::NoDotAndDotDot | QDir::Readable );
+
+  foreach ( const QString &name, directory.entryList() ) {
+    if ( !knownNames.remove( name ) )
+      return true;
+  }
 
-  synchronizeCollection( cols.first().id() );
+  return !knownNames.isEmpty();
+}
+
+void PlainNotesResource::fsWatchCollectionFetched( const Akonadi::Collection &collection )
+{
+  synchronizeCollection( collection.id() );
 }
 
 void PlainNotesResource::fileChanged( const QString &file )
 {
   kWarning() << "file changed" << file;
 
+  mPayloadCache->invalidate( file );
+
+  mDirtyFiles.insert( file );
+  mDirtyTimer->start();
+}
+
+void PlainNotesResource::updateItemForFile( const QString &file )
+{
   QFileInfo fi( file );
 
   QString key = fi.fileName();
@@ -232,47 +471,286 @@ void PlainNotesResource::fileChanged( const QString &file )
   item.setRemoteId( key );
   item.setParentCollection( col );
 
-  ItemFetchJob *job = new ItemFetchJob( item, this );
-  job->fetchScope().setAncestorRetrieval( ItemFetchScope::All );
-  connect( job, SIGNAL(result(KJob*)), SLOT(fsWatchFileFetchResult(KJob*)) );
+  mDispatcher->fetchItem( item );
 }
 
-void PlainNotesResource::fsWatchFileFetchResult( KJob* job )
+void PlainNotesResource::updateGitWatching()
 {
-  if ( job->error() ) {
-    kDebug() << job->errorString();
+  foreach ( const QString &root, mGitRoots )
+    mFsWatcher->removeFile( root + QLatin1String( "/.git/logs/HEAD" ) );
+
+  mGitRoots.clear();
+  mGitHeads.clear();
+
+  if ( !mSettings->gitIntegration() )
     return;
+
+  // HEAD's reflog gets a line appended whenever HEAD moves (checkout, pull, reset, commit)
+  foreach ( const QString &root, baseDirectoryPaths() ) {
+    if ( !QFileInfo( root + QLatin1String( "/.git/logs/HEAD" ) ).isFile() )
+      continue;
+
+    mGitRoots << root;
+    mGitHeads.insert( root, readGitHead( root ) );
+    mFsWatcher->addFile( root + QLatin1String( "/.git/logs/HEAD" ) );
+  }
+}
+
+QStringList PlainNotesResource::lockedGitRoots() const
+{
+  QStringList roots;
+
+  foreach ( const QString &root, mGitRoots ) {
+    const QFileInfo lock( root + QLatin1String( "/.git/index.lock" ) );
+
+    if ( !lock.exists() )
+      continue;
+
+    // A crashed or killed git leaves its lock behind, don't wait for that forever
+    if ( lock.lastModified().secsTo( QDateTime::currentDateTime() ) > GIT_LOCK_TIMEOUT ) {
+      kWarning() << "Ignoring stale git lock" << lock.filePath();
+      continue;
+    }
+
+    roots << root;
+  }
+
+  return roots;
+}
+
+QString PlainNotesResource::readGitHead( const QString &root ) const
+{
+  QFile head( root + QLatin1String( "/.git/HEAD" ) );
+
+  if ( !head.open( QIODevice::ReadOnly ) )
+    return QString();
+
+  // Either a detached commit or "ref: refs/heads/<branch>"
+  const QByteArray content = head.readAll().trimmed();
+
+  if ( !content.startsWith( "ref: " ) )
+    return QString::fromLatin1( content );
+
+  const QByteArray ref = content.mid( 5 );
+
+  QFile refFile( root + QLatin1String( "/.git/" ) + QFile::decodeName( ref ) );
+  if ( refFile.open( QIODevice::ReadOnly ) )
+    return QString::fromLatin1( refFile.readAll().trimmed() );
+
+  // Refs untouched since the last gc only live in packed-refs, as "<sha> <ref>" lines
+  QFile packedRefs( root + QLatin1String( "/.git/packed-refs" ) );
+  if ( packedRefs.open( QIODevice::ReadOnly ) ) {
+    while ( !packedRefs.atEnd() ) {
+      const QByteArray line = packedRefs.readLine().trimmed();
+
+      if ( line.endsWith( ' ' + ref ) )
+        return QString::fromLatin1( line.left( line.indexOf( ' ' ) ) );
+    }
   }
 
-  Item::List items = qobject_cast<ItemFetchJob*>( job )->items();
+  return QString(); // Unborn branch, nothing committed yet
+}
+
+void PlainNotesResource::gitHeadChanged( const QString &root )
+{
+  // The reflog only tells that HEAD moved, several moves can arrive as one event and
+  // rebases or resets finish with entries not describing the whole change, so the
+  // diff always covers everything since the last synchronized commit.
+  const QString oldHead = mGitHeads.value( root );
+  const QString newHead = readGitHead( root );
 
-  if ( items.isEmpty() )
+  if ( oldHead == newHead )
     return;
 
-  Item newItem( items.at( 0 ) );
+  mGitHeads.insert( root, newHead );
 
-  const QString filePath = directoryForCollection( newItem.parentCollection() ) + QDir::separator() + newItem.remoteId();
+  kDebug() << "git HEAD moved from" << oldHead << "to" << newHead << "in" << root;
 
-  QFile file( filePath );
+  if ( oldHead.isEmpty() || newHead.isEmpty() ) { // First commit or unreadable HEAD, no point in diffing
+    mDirtyDirectories.insert( root );
+    mDirtyTimer->start();
+    return;
+  }
 
-  if ( !file.open( QIODevice::ReadOnly ) ) {
-    kWarning() << "Unable to open file" << filePath ;
+  KProcess *process = new KProcess( this );
+  process->setOutputChannelMode( KProcess::OnlyStdoutChannel );
+  process->setWorkingDirectory( root );
+  process->setProgram( QLatin1String( "git" ), QStringList() << QLatin1String( "diff" ) << QLatin1String( "--name-status" )
+                                                             << QLatin1String( "-z" ) << QLatin1String( "-M" ) << oldHead << newHead );
+  mGitDiffRoots.insert( process, root );
+  connect( process, SIGNAL(finished(int,QProcess::ExitStatus)), SLOT(gitDiffFinished(int,QProcess::ExitStatus)) );
+  connect( process, SIGNAL(error(QProcess::ProcessError)), SLOT(gitDiffError(QProcess::ProcessError)) );
+  process->start();
+}
+
+void PlainNotesResource::gitDiffError( QProcess::ProcessError error )
+{
+  // Other errors are followed by finished(), a process that never started is not
+  if ( error != QProcess::FailedToStart )
+    return;
+
+  KProcess *process = qobject_cast<KProcess*>( sender() );
+  process->deleteLater();
+
+  const QString root = mGitDiffRoots.take( process );
+
+  kWarning() << "Unable to run git in" << root << ", falling back to a full synchronization";
+  mDirtyDirectories.insert( root );
+  mDirtyTimer->start();
+}
+
+void PlainNotesResource::gitDiffFinished( int exitCode, QProcess::ExitStatus exitStatus )
+{
+  KProcess *process = qobject_cast<KProcess*>( sender() );
+  process->deleteLater();
+
+  const QString root = mGitDiffRoots.take( process );
+
+  if ( exitStatus != QProcess::NormalExit || exitCode != 0 ) {
+    kWarning() << "git diff failed in" << root << ", falling back to a full synchronization";
+    mDirtyDirectories.insert( root );
+    mDirtyTimer->start();
     return;
   }
 
-  QString data = QTextStream( &file ).readAll();
+  // Records are "<status>\0<path>\0", renames and copies carry a second path
+  const QList<QByteArray> fields = process->readAllStandardOutput().split( '\0' );
 
-  file.close();
+  for ( int i = 0; i + 1 < fields.count(); i += 2 ) {
+    const QByteArray status = fields.at( i );
+    const QString path = root + QDir::separator() + QFile::decodeName( fields.at( i + 1 ) );
 
-  setItemPayload( newItem, filePath, data );
+    if ( status.startsWith( 'R' ) || status.startsWith( 'C' ) ) {
+      if ( i + 2 >= fields.count() )
+        break;
+
+      const QString targetPath = root + QDir::separator() + QFile::decodeName( fields.at( i + 2 ) );
+      ++i;
+
+      if ( status == "R100" && !isIgnoredPath( path, root ) && !isIgnoredPath( targetPath, root ) ) {
+        renameKnownItem( path, targetPath ); // Content unchanged, keep the item
+      } else {
+        markFileChanged( targetPath, root );
+      }
+
+      if ( status.startsWith( 'R' ) )
+        markDirectoryChanged( QFileInfo( path ).path(), root );
+      markDirectoryChanged( QFileInfo( targetPath ).path(), root );
+    } else if ( status.startsWith( 'M' ) || status.startsWith( 'T' ) ) {
+      markFileChanged( path, root );
+    } else {
+      markDirectoryChanged( QFileInfo( path ).path(), root ); // Added or deleted
+    }
+  }
+
+  mDirtyTimer->start();
+}
+
+void PlainNotesResource::markFileChanged( const QString &file, const QString &root )
+{
+  if ( isIgnoredPath( file, root ) )
+    return;
 
-  new ItemModifyJob( newItem );
+  mPayloadCache->invalidate( file );
+  mDirtyFiles.insert( file );
+}
+
+void PlainNotesResource::markDirectoryChanged( const QString &dir, const QString &root )
+{
+  if ( isIgnoredPath( dir, root ) )
+    return;
+
+  // Directories not known yet need the collection tree to be refreshed, then the items of their root
+  if ( mCollectionTree.find( dir ) >= 0 ) {
+    mDirtyDirectories.insert( dir );
+  } else {
+    mCollectionTreeDirty = true;
+    mDirtyDirectories.insert( root );
+  }
+}
+
+bool PlainNotesResource::isIgnoredPath( const QString &path, const QString &root ) const
+{
+  foreach ( const QString &component, path.mid( root.length() ).split( QDir::separator(), QString::SkipEmptyParts ) ) {
+    if ( isIgnored( component ) )
+      return true;
+  }
+
+  return false;
+}
+
+void PlainNotesResource::fsWatchItemsFetched( const Akonadi::Item::List &items )
+{
+  foreach ( const Item &item, items ) {
+    Item newItem( item );
+
+    const QString filePath = directoryForCollection( newItem.parentCollection() ) + QDir::separator() + newItem.remoteId();
+
+    const PayloadCache::FileState fileState = PayloadCache::fileState( filePath );
+
+    QFile file( filePath );
+
+    if ( !file.open( QIODevice::ReadOnly ) ) {
+      kWarning() << "Unable to open file" << filePath ;
+      continue;
+    }
+
+    QString data = QTextStream( &file ).readAll();
+
+    file.close();
+
+    setItemPayload( newItem, filePath, data );
+    mPayloadCache->insert( filePath, newItem.payload<KMime::Message::Ptr>(), fileState, newItem.attribute<NoteMetadataAttribute>() );
+
+    mDispatcher->modifyItem( newItem );
+  }
+}
+
+void PlainNotesResource::renameKnownItem( const QString &sourceFilePath, const QString &targetFilePath )
+{
+  const QFileInfo source( sourceFilePath );
+  const QFileInfo target( targetFilePath );
+
+  const Collection col = collectionForDirectory( source.path() );
+  if ( col.remoteId().isEmpty() ) {
+    kDebug() << "Unable to find collection for path" << source.path();
+    return;
+  }
+
+  const Collection targetCol = collectionForDirectory( target.path() );
+  if ( targetCol.remoteId().isEmpty() ) {
+    kDebug() << "Unable to find collection for path" << target.path();
+    return;
+  }
+
+  kDebug() << "file renamed" << sourceFilePath << "to" << targetFilePath;
+
+  Item item;
+  item.setRemoteId( source.fileName() );
+  item.setParentCollection( col );
+
+  ++mPendingRenames;
+
+  mDispatcher->renameItem( item, targetCol, target.fileName() );
+}
+
+void PlainNotesResource::renameFinished()
+{
+  if ( --mPendingRenames > 0 )
+    return;
+
+  const QStringList dirs = mDirectoriesAwaitingRenames;
+  mDirectoriesAwaitingRenames.clear();
+
+  foreach ( const QString &dir, dirs )
+    synchronizeDirectory( dir );
 }
 
 // Item handling
 
 void PlainNotesResource::itemAdded( const Akonadi::Item &item, const Akonadi::Collection &collection )
 {
+  flushPendingWrites();
   saveItem( item, collection, true, true );
 }
 
@@ -289,9 +767,114 @@ void PlainNotesResource::itemChanged( const Akonadi::Item &item, const QSet<QByt
     }
   }
 
+  // Body-only changes (e.g. editor autosave) are committed right away but written to disk
+  // delayed, so that a burst of changes to the same note ends up as a single write
+  if ( bodyChanged && !headChanged && !mSettings->readOnly() && !item.remoteId().isEmpty()
+       && item.hasPayload<KMime::Message::Ptr>() ) {
+    const QString parentPath = directoryForCollection( item.parentCollection() );
+
+    if ( parentPath.isNull() ) { // Incomplete ancestor chain, let saveItem() deal with it
+      flushPendingWrites();
+      saveItem( item, item.parentCollection(), headChanged, bodyChanged );
+      return;
+    }
+
+    const QString filePath = parentPath + QDir::separator() + item.remoteId();
+
+    PendingWrite &write = mPendingWrites[item.id()];
+    write.filePath = filePath;
+    write.data = item.payload<KMime::Message::Ptr>()->mainBodyPart()->decodedText( true, true );
+
+    mPayloadCache->invalidate( filePath );
+
+    if ( !mWriteTimer->isActive() )
+      mWriteTimer->start();
+
+    Item newItem( item );
+    setItemMetadata( newItem, NoteMetadataAttribute::fromText( write.data ) );
+
+    changeCommitted( newItem );
+    return;
+  }
+
+  flushPendingWrites();
   saveItem( item, item.parentCollection(), headChanged, bodyChanged );
 }
 
+void PlainNotesResource::flushPendingWrites()
+{
+  mWriteTimer->stop();
+
+  if ( mPendingWrites.isEmpty() )
+    return;
+
+  const QHash<Item::Id, PendingWrite> writes = mPendingWrites;
+  mPendingWrites.clear();
+
+  QSet<QString> parentPaths;
+  foreach ( const PendingWrite &write, writes )
+    parentPaths.insert( QFileInfo( write.filePath ).path() );
+
+  foreach ( const QString &parentPath, parentPaths )
+    mFsWatcher->removeDir( parentPath );
+
+  QStringList failedFiles;
+
+  for ( QHash<Item::Id, PendingWrite>::const_iterator it = writes.constBegin(); it != writes.constEnd(); ++it ) {
+    QString errorString;
+
+    // The change is already committed, so keep it queued and retry instead of losing the edit
+    if ( !writeNoteFile( it->filePath, it->data, &errorString ) ) {
+      kWarning() << "Unable to write to file" << it->filePath << ":" << errorString;
+      failedFiles << it->filePath;
+      mPendingWrites.insert( it.key(), it.value() );
+    }
+  }
+
+  foreach ( const QString &parentPath, parentPaths )
+    mFsWatcher->addDir( parentPath, KDirWatch::WatchFiles );
+
+  if ( !failedFiles.isEmpty() ) {
+    // Reported once when writing starts to fail, retries stay quiet until they succeed
+    if ( !mWritesFailing ) {
+      const QString message = i18n( "Unable to save changes to '%1', will retry.", failedFiles.join( QLatin1String( "', '" ) ) );
+
+      emit error( message );
+      emit status( Broken, message );
+
+      mWritesFailing = true;
+    }
+
+    mWriteTimer->start();
+  } else if ( mWritesFailing ) {
+    mWritesFailing = false;
+    emit status( Idle );
+  }
+}
+
+bool PlainNotesResource::writeNoteFile( const QString &filePath, const QString &data, QString *errorString )
+{
+  mPayloadCache->invalidate( filePath );
+
+  QFile file( filePath );
+  QTextStream stream( &file );
+
+  if ( !file.open( QIODevice::WriteOnly ) ) {
+    if ( errorString )
+      *errorString = file.errorString();
+    return false;
+  }
+
+  stream << data;
+  stream.flush();
+
+  file.close();
+
+  rememberFile( QFileInfo( filePath ) );
+
+  return true;
+}
+
 void PlainNotesResource::saveItem( const Akonadi::Item &item, const Akonadi::Collection &parentCollection, bool saveHead, bool saveBody )
 {
   if ( !saveHead && !saveBody ) {
@@ -325,6 +908,7 @@ void PlainNotesResource::saveItem( const Akonadi::Item &item, const Akonadi::Col
       const QString targetFilePath = parentPath + QDir::separator() + newItem.remoteId();
 
       mFsWatcher->removeDir( parentPath );
+      mPayloadCache->invalidate( sourceFilePath );
 
       if ( QFile::exists( sourceFilePath ) && !QFile::rename(sourceFilePath, targetFilePath) ) { // If file exists but can't be renamed - it's a problem
         cancelTask( i18n( "Unable to rename file from '%1' to '%2'", sourceFilePath, targetFilePath ) );
@@ -332,6 +916,8 @@ void PlainNotesResource::saveItem( const Akonadi::Item &item, const Akonadi::Col
       }
 
       mFsWatcher->addDir( parentPath, KDirWatch::WatchFiles );
+
+      rememberFile( QFileInfo( targetFilePath ) );
     }
 
     if ( saveBody ) {
@@ -340,19 +926,16 @@ void PlainNotesResource::saveItem( const Akonadi::Item &item, const Akonadi::Col
 
       mFsWatcher->removeDir( parentPath );
 
-      QFile file( filePath );
-      QTextStream stream( &file );
+      const QString data = mail->mainBodyPart()->decodedText( true, true );
+      QString errorString;
+
+      setItemMetadata( newItem, NoteMetadataAttribute::fromText( data ) );
 
-      if ( !file.open( QIODevice::WriteOnly ) ) {
-        cancelTask( i18n( "Unable to write to file '%1': %2", filePath, file.errorString() ) );
+      if ( !writeNoteFile( filePath, data, &errorString ) ) {
+        cancelTask( i18n( "Unable to write to file '%1': %2", filePath, errorString ) );
         return;
       }
 
-      stream << mail->mainBodyPart()->decodedText( true, true );
-      stream.flush();
-
-      file.close();
-
       mFsWatcher->addDir( parentPath, KDirWatch::WatchFiles );
     }
   } else {
@@ -364,6 +947,8 @@ void PlainNotesResource::saveItem( const Akonadi::Item &item, const Akonadi::Col
 
 void PlainNotesResource::itemRemoved( const Akonadi::Item &item )
 {
+  flushPendingWrites();
+
   if ( mSettings->readOnly() ) {
     cancelTask( i18n( "Trying to write to a read-only file: '%1'", item.remoteId() ) );
     return;
@@ -382,6 +967,9 @@ void PlainNotesResource::itemRemoved( const Akonadi::Item &item )
 
   mFsWatcher->removeDir( parentPath );
 
+  forgetFile( filePath );
+  mPayloadCache->invalidate( filePath );
+
   if ( !QFile::remove( filePath ) ) {
     cancelTask( i18n( "Unable to remove file '%1'", filePath ) );
     return;
@@ -395,6 +983,8 @@ void PlainNotesResource::itemRemoved( const Akonadi::Item &item )
 void PlainNotesResource::itemMoved( const Akonadi::Item &item, const Akonadi::Collection &collectionSource,
                                   const Akonadi::Collection &collectionDestination )
 {
+  flushPendingWrites();
+
   const QString sourceParentPath = directoryForCollection( collectionSource );
   const QString sourceFilePath = sourceParentPath + QDir::separator() + item.remoteId();
 
@@ -404,9 +994,12 @@ void PlainNotesResource::itemMoved( const Akonadi::Item &item, const Akonadi::Co
   mFsWatcher->removeDir( sourceParentPath );
   mFsWatcher->removeDir( targetParentPath );
 
-  if ( QFile::rename( sourceFilePath, targetFilePath ) )
+  mPayloadCache->invalidate( sourceFilePath );
+
+  if ( QFile::rename( sourceFilePath, targetFilePath ) ) {
+    rememberFile( QFileInfo( targetFilePath ) );
     changeProcessed();
-  else
+  } else
     cancelTask( i18n( "Unable to move file '%1' to '%2', '%2' already exists.", sourceFilePath, targetFilePath ) );
 
   mFsWatcher->addDir( sourceParentPath, KDirWatch::WatchFiles );
@@ -417,6 +1010,8 @@ void PlainNotesResource::itemMoved( const Akonadi::Item &item, const Akonadi::Co
 
 void PlainNotesResource::collectionAdded( const Akonadi::Collection &collection, const Akonadi::Collection &parent )
 {
+  flushPendingWrites();
+
   if ( mSettings->readOnly() ) {
     cancelTask( i18n( "Trying to write to a read-only directory: '%1'", parent.remoteId() ) );
     return;
@@ -434,6 +1029,10 @@ void PlainNotesResource::collectionAdded( const Akonadi::Collection &collection,
 
   initializeDirectory( directoryPath );
 
+  const int parentNode = mCollectionTree.find( parentPath );
+  if ( parentNode >= 0 )
+    mCollectionTree.addNode( parentNode, collection.name() );
+
   mFsWatcher->addDir( parentPath, KDirWatch::WatchFiles );
   mFsWatcher->addDir( directoryPath, KDirWatch::WatchFiles ); // Watch new directory
 
@@ -444,13 +1043,16 @@ void PlainNotesResource::collectionAdded( const Akonadi::Collection &collection,
 
 void PlainNotesResource::collectionChanged( const Akonadi::Collection &collection )
 {
+  flushPendingWrites();
+
   if ( mSettings->readOnly() ) {
     cancelTask( i18n( "Trying to write to a read-only directory: '%1'", collection.remoteId() ) );
     return;
   }
 
   if ( collection.parentCollection() == Collection::root() ) {
-    if ( collection.name() != name() )
+    // only the primary root carries the resource name, additional roots keep their directory name
+    if ( collection.remoteId() == baseDirectoryPath() && collection.name() != name() )
       setName( collection.name() );
     changeProcessed();
     return;
@@ -477,6 +1079,12 @@ void PlainNotesResource::collectionChanged( const Akonadi::Collection &collectio
     return;
   }
 
+  const int node = mCollectionTree.find( sourcePath );
+  if ( node >= 0 )
+    mCollectionTree.renameNode( node, newCollection.remoteId() );
+
+  relocateKnownFiles( sourcePath, targetPath );
+
   mFsWatcher->addDir( parentPath );
   mFsWatcher->addDir( targetPath ); // Watch directory with new name
 
@@ -485,6 +1093,8 @@ void PlainNotesResource::collectionChanged( const Akonadi::Collection &collectio
 
 void PlainNotesResource::collectionRemoved( const Akonadi::Collection &collection )
 {
+  flushPendingWrites();
+
   if ( mSettings->readOnly() ) {
     cancelTask( i18n( "Trying to write to a read-only directory: '%1'", collection.remoteId() ) );
     return;
@@ -496,37 +1106,90 @@ void PlainNotesResource::collectionRemoved( const Akonadi::Collection &collectio
   mFsWatcher->removeDir( directoryPath ); // Don't watch removed directory
   mFsWatcher->removeDir( parentPath );
 
-  if ( !removeDirectory( directoryPath ) ) {
-    cancelTask( i18n( "Unable to delete folder '%1'.", collection.name() ) );
-    return;
-  }
-
-  mFsWatcher->addDir( parentPath, KDirWatch::WatchFiles );
-
-  changeProcessed();
+  // Large folders take a while, so remove them in the background and finish the change afterwards
+  PendingTreeOperation pending;
+  pending.watchPaths << parentPath;
+  pending.sourcePath = directoryPath;
+  pending.node = mCollectionTree.find( directoryPath );
+  pending.targetParentNode = -1;
+  pending.errorMessage = i18n( "Unable to delete folder '%1'.", collection.name() );
+
+  TreeOperation *operation = new TreeOperation( this );
+  mTreeOperations.insert( operation, pending );
+  connect( operation, SIGNAL(progress(int)), SIGNAL(percent(int)) );
+  connect( operation, SIGNAL(finished(bool)), SLOT(treeOperationFinished(bool)) );
+  operation->startRemove( directoryPath );
 }
 
 void PlainNotesResource::collectionMoved( const Akonadi::Collection &collection, const Akonadi::Collection &collectionSource,
                                         const Akonadi::Collection &collectionDestination )
 {
+  flushPendingWrites();
+
   const QString sourceParentPath = directoryForCollection( collectionSource );
   const QString targetParentPath = directoryForCollection( collectionDestination );
 
   const QString sourcePath = sourceParentPath + QDir::separator() + collection.remoteId();
   const QString targetPath = targetParentPath + QDir::separator() + collection.remoteId();
 
+  if ( QFileInfo( targetPath ).exists() ) {
+    cancelTask( i18n( "Unable to move directory '%1' to '%2', '%2' already exists.", sourcePath, targetPath ) );
+    return;
+  }
+
   mFsWatcher->removeDir( sourcePath ); // Don't watch moved directory
   mFsWatcher->removeDir( sourceParentPath );
   mFsWatcher->removeDir( targetParentPath );
 
-  if ( QFile::rename( sourcePath, targetPath ) )
-    changeProcessed();
-  else
-    cancelTask( i18n( "Unable to move directory '%1' to '%2', '%2' already exists.", sourcePath, targetPath ) );
+  // A rename, unless the target is on another filesystem, then it is copied in the background
+  PendingTreeOperation pending;
+  pending.watchPaths << targetPath << sourceParentPath << targetParentPath;
+  pending.sourcePath = sourcePath;
+  pending.targetPath = targetPath;
+  pending.node = mCollectionTree.find( sourcePath );
+  pending.targetParentNode = mCollectionTree.find( targetParentPath );
+  pending.errorMessage = i18n( "Unable to move directory '%1' to '%2'.", sourcePath, targetPath );
+
+  TreeOperation *operation = new TreeOperation( this );
+  mTreeOperations.insert( operation, pending );
+  connect( operation, SIGNAL(progress(int)), SIGNAL(percent(int)) );
+  connect( operation, SIGNAL(finished(bool)), SLOT(treeOperationFinished(bool)) );
+  operation->startMove( sourcePath, targetPath );
+}
 
-  mFsWatcher->addDir( targetPath, KDirWatch::WatchFiles ); // Watch target directory
-  mFsWatcher->addDir( sourceParentPath, KDirWatch::WatchFiles );
-  mFsWatcher->addDir( targetParentPath, KDirWatch::WatchFiles );
+void PlainNotesResource::treeOperationFinished( bool success )
+{
+  TreeOperation *operation = qobject_cast<TreeOperation*>( sender() );
+  operation->deleteLater();
+
+  const PendingTreeOperation pending = mTreeOperations.take( operation );
+
+  foreach ( const QString &path, pending.watchPaths ) {
+    if ( QFileInfo( path ).isDir() )
+      mFsWatcher->addDir( path, KDirWatch::WatchFiles );
+  }
+
+  if ( success ) {
+    // The tree only follows once the directory is really gone, and only if it wasn't rebuilt meanwhile
+    if ( pending.node >= 0 && mCollectionTree.find( pending.sourcePath ) == pending.node ) {
+      if ( pending.targetParentNode >= 0 ) {
+        mCollectionTree.moveNode( pending.node, pending.targetParentNode );
+      } else {
+        mCollectionTree.removeNode( pending.node );
+
+        if ( !pending.targetPath.isEmpty() ) // Moved below a folder the tree doesn't know, pick it up again
+          mCollectionTreeDirty = true;
+      }
+    }
+
+    // Files below a removed directory are dropped (empty target), below a moved one they get the new path
+    relocateKnownFiles( pending.sourcePath, pending.targetPath );
+
+    changeProcessed();
+  } else {
+    kWarning() << operation->errorString();
+    cancelTask( pending.errorMessage + QLatin1Char( ' ' ) + operation->errorString() );
+  }
 }
 
 // Internal helpers
@@ -536,23 +1199,46 @@ QString PlainNotesResource::baseDirectoryPath() const
   return QDir::cleanPath( mSettings->path() );
 }
 
-bool PlainNotesResource::removeDirectory( const QDir &directory )
+QStringList PlainNotesResource::baseDirectoryPaths() const
 {
-  const QFileInfoList infos = directory.entryInfoList( QDir::Files|QDir::Dirs|QDir::NoDotAndDotDot );
-  foreach ( const QFileInfo &info, infos ) {
-    if ( info.isDir() ) {
-      if ( !removeDirectory( QDir( info.absoluteFilePath() ) ) )
-        return false;
-    } else {
-      if ( !QFile::remove( info.filePath() ) )
-        return false;
+  QStringList paths;
+  paths << baseDirectoryPath();
+
+  foreach ( const QString &path, mSettings->additionalPaths() ) {
+    const QString cleanPath = QDir::cleanPath( path );
+
+    if ( cleanPath.isEmpty() || paths.contains( cleanPath ) )
+      continue;
+
+    // Earlier roots win, so overlapping trees are never shown or watched twice
+    bool overlaps = !rootDirectoryForPath( cleanPath, paths ).isEmpty();
+    foreach ( const QString &root, paths )
+      overlaps = overlaps || !rootDirectoryForPath( root, QStringList() << cleanPath ).isEmpty();
+
+    if ( overlaps ) {
+      kWarning() << "Ignoring notes directory overlapping with another one:" << cleanPath;
+      continue;
     }
+
+    paths << cleanPath;
   }
 
-  if ( !QDir::root().rmdir( directory.absolutePath() ) )
-    return false;
+  return paths;
+}
 
-  return true;
+QString PlainNotesResource::rootDirectoryForPath( const QString &path ) const
+{
+  return rootDirectoryForPath( path, baseDirectoryPaths() );
+}
+
+QString PlainNotesResource::rootDirectoryForPath( const QString &path, const QStringList &roots ) const
+{
+  foreach ( const QString &root, roots ) {
+    if ( path == root || path.startsWith( root + QDir::separator() ) )
+      return root;
+  }
+
+  return QString();
 }
 
 void PlainNotesResource::initializeDirectory( const QString &path ) const
@@ -589,8 +1275,8 @@ QString PlainNotesResource::directoryForCollection( const Collection& collection
   }
 
   if ( collection.parentCollection() == Collection::root() ) {
-    kWarning( collection.remoteId() != baseDirectoryPath() ) << "RID mismatch, is " << collection.remoteId()
-                                                             << " expected " << baseDirectoryPath();
+    kWarning( !baseDirectoryPaths().contains( collection.remoteId() ) ) << "RID mismatch, is " << collection.remoteId()
+                                                                          << " expected one of " << baseDirectoryPaths();
     return collection.remoteId();
   }
 
@@ -604,10 +1290,18 @@ QString PlainNotesResource::directoryForCollection( const Collection& collection
 
 Collection PlainNotesResource::collectionForDirectory( const QString & path ) const
 {
+  const int node = mCollectionTree.find( path );
+  if ( node >= 0 )
+    return collectionForNode( node );
+
+  // Not known (yet), derive the ancestor chain from the path itself
   QFileInfo fi( path );
   Collection col;
 
-  if ( fi.filePath() == baseDirectoryPath() ) {
+  if ( rootDirectoryForPath( fi.filePath() ).isEmpty() ) // outside of all notes directories
+    return col;
+
+  if ( baseDirectoryPaths().contains( fi.filePath() ) ) {
     col.setRemoteId( fi.filePath() );
     col.setParentCollection( Collection::root() );
   } else {
@@ -618,33 +1312,142 @@ Collection PlainNotesResource::collectionForDirectory( const QString & path ) co
   return col;
 }
 
-Collection::List PlainNotesResource::createCollectionsForDirectory( const QDir &parentDirectory, const Collection &parentCollection ) const
+Collection PlainNotesResource::collectionForNode( int node ) const
 {
-  mFsWatcher->addDir( parentDirectory.path(), KDirWatch::WatchFiles );
+  Collection col;
+  col.setRemoteId( mCollectionTree.name( node ) );
+  col.setParentCollection( mCollectionTree.isRoot( node ) ? Collection::root() : collectionForNode( mCollectionTree.parent( node ) ) );
 
-  Collection::List collections;
+  return col;
+}
+
+void PlainNotesResource::buildCollectionTree( const QDir &parentDirectory, int parentNode )
+{
+  mFsWatcher->addDir( parentDirectory.path(), KDirWatch::WatchFiles );
 
   QDir dir( parentDirectory );
   dir.setFilter( QDir::Dirs | QDir::NoDotAndDotDot | QDir::Readable );
   const QFileInfoList entries = dir.entryInfoList();
 
-  foreach ( const QFileInfo &entry, entries ) {
-    QDir subdir( entry.absoluteFilePath() );
+  foreach ( const QFileInfo &entry, entries )
+    buildCollectionTree( QDir( entry.absoluteFilePath() ), mCollectionTree.addNode( parentNode, entry.fileName() ) );
+}
+
+Collection::List PlainNotesResource::collectionsForTree() const
+{
+  // Akonadi objects only exist while handing the tree over, all of them share mime types and rights
+  const Collection::Rights rootRights = supportedRights( true );
+  const Collection::Rights rights = supportedRights( false );
+
+  QVector<Collection> nodeCollections( mCollectionTree.count() );
+  Collection::List collections;
+  collections.reserve( mCollectionTree.count() );
+
+  // Parents always precede their children in the tree
+  for ( int node = 0; node < mCollectionTree.count(); ++node ) {
+    const int parent = mCollectionTree.parent( node );
+
+    if ( parent == -2 || ( parent >= 0 && nodeCollections.at( parent ).remoteId().isEmpty() ) )
+      continue; // removed, or below a removed node
 
-    Collection collection;
-    collection.setParentCollection( parentCollection );
-    collection.setRemoteId( entry.fileName() );
-    collection.setName( entry.fileName() );
+    Collection &collection = nodeCollections[node];
+    collection.setRemoteId( mCollectionTree.name( node ) );
     collection.setContentMimeTypes( mSupportedMimeTypes );
-    collection.setRights( supportedRights( false ) );
+
+    if ( mCollectionTree.isRoot( node ) ) {
+      // the first root is named after the resource
+      collection.setParentCollection( Collection::root() );
+      collection.setName( collection.remoteId() == baseDirectoryPath() ? name() : QDir( collection.remoteId() ).dirName() );
+      collection.setRights( rootRights );
+    } else {
+      collection.setParentCollection( nodeCollections.at( parent ) );
+      collection.setName( collection.remoteId() );
+      collection.setRights( rights );
+    }
 
     collections << collection;
-    collections << createCollectionsForDirectory( subdir, collection );
   }
 
   return collections;
 }
 
+PlainNotesResource::KnownFile *PlainNotesResource::rememberFile( const QFileInfo &fileInfo )
+{
+  const FileIdentity id = FileIdentity::forPath( fileInfo.filePath() );
+
+  if ( !id.isValid() )
+    return 0;
+
+  const qint64 size = fileInfo.size();
+  const uint lastModified = fileInfo.lastModified().toTime_t();
+
+  KnownFile &known = mKnownFiles[id]; // New entries start zeroed, so without known metadata
+
+  if ( known.size != size || known.lastModified != lastModified )
+    known.metadataKnown = false;
+
+  known.path = fileInfo.filePath();
+  known.size = size;
+  known.lastModified = lastModified;
+
+  return &known;
+}
+
+FileIdentity PlainNotesResource::knownIdentityForPath( const QString &filePath ) const
+{
+  QHash<FileIdentity, KnownFile>::const_iterator it = mKnownFiles.constBegin();
+  for ( ; it != mKnownFiles.constEnd(); ++it ) {
+    if ( it->path == filePath )
+      return it.key();
+  }
+
+  return FileIdentity();
+}
+
+void PlainNotesResource::forgetFile( const QString &filePath )
+{
+  mKnownFiles.remove( FileIdentity::forPath( filePath ) );
+}
+
+void PlainNotesResource::forgetMissingFiles( const QStringList &directories, const QSet<QString> &existingFiles )
+{
+  if ( directories.isEmpty() )
+    return;
+
+  const QSet<QString> dirs = directories.toSet();
+
+  QHash<FileIdentity, KnownFile>::iterator it = mKnownFiles.begin();
+  while ( it != mKnownFiles.end() ) {
+    const QString &path = it->path;
+    const QString dir = path.left( path.lastIndexOf( QDir::separator() ) );
+
+    if ( dirs.contains( dir ) && !existingFiles.contains( path ) )
+      it = mKnownFiles.erase( it );
+    else
+      ++it;
+  }
+}
+
+void PlainNotesResource::relocateKnownFiles( const QString &oldPath, const QString &newPath )
+{
+  if ( oldPath.isEmpty() )
+    return;
+
+  const QString oldPrefix = oldPath + QDir::separator();
+
+  QHash<FileIdentity, KnownFile>::iterator it = mKnownFiles.begin();
+  while ( it != mKnownFiles.end() ) {
+    if ( !it->path.startsWith( oldPrefix ) ) {
+      ++it;
+    } else if ( newPath.isEmpty() ) {
+      it = mKnownFiles.erase( it );
+    } else {
+      it->path = newPath + QDir::separator() + it->path.mid( oldPrefix.length() );
+      ++it;
+    }
+  }
+}
+
 bool PlainNotesResource::isIgnored( QString file ) const
 {
   return file.startsWith(".") || file.startsWith("~") || file.endsWith("~");
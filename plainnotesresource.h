@@ -1,14 +1,26 @@
 #ifndef PLAINNOTESRESOURCE_H
 #define PLAINNOTESRESOURCE_H
 
+#include "collectiontree.h"
+#include "fileidentity.h"
+
 #include <Akonadi/ResourceBase>
 #include <Akonadi/Collection>
 
 #include <QDir>
+#include <QProcess>
+#include <QSet>
 
 class KDirWatch;
+class KProcess;
+class QDirIterator;
+class QTimer;
 
+class JobDispatcher;
+class NoteMetadataAttribute;
+class PayloadCache;
 class PlainNotesResourceSettings;
+class TreeOperation;
 
 class PlainNotesResource : public Akonadi::ResourceBase,
                            public Akonadi::AgentBase::ObserverV2
@@ -47,32 +59,113 @@ class PlainNotesResource : public Akonadi::ResourceBase,
                                   const Akonadi::Collection &collectionDestination );
 
   private slots:
+    void retrieveNextItemChunk();
+
     void directoryChanged( const QString &dir );
     void fileChanged( const QString &file );
+    void processDirtyPaths();
+    void flushPendingWrites();
+
+    void fsWatchCollectionFetched( const Akonadi::Collection &collection );
+    void fsWatchItemsFetched( const Akonadi::Item::List &items );
+
+    void renameFinished();
 
-    void fsWatchDirFetchResult( KJob* job );
-    void fsWatchFileFetchResult( KJob* job );
+    void treeOperationFinished( bool success );
+
+    void gitDiffFinished( int exitCode, QProcess::ExitStatus exitStatus );
+    void gitDiffError( QProcess::ProcessError error );
 
   private:
+    struct PendingWrite
+    {
+      QString filePath;
+      QString data;
+    };
+
+    struct PendingTreeOperation
+    {
+      QStringList watchPaths; // Watches to restore once the operation is done
+      QString sourcePath;
+      QString targetPath;     // Empty for removals
+      int node;               // Collection tree node of sourcePath, -1 if unknown
+      int targetParentNode;   // New parent node for moves, -1 if unknown
+      QString errorMessage;
+    };
+
+    struct KnownFile
+    {
+      QString path;
+      qint64 size;
+      uint lastModified; // seconds since epoch
+      bool metadataKnown; // NoteMetadataAttribute was delivered for this size and time
+    };
+
     void saveItem( const Akonadi::Item &item, const Akonadi::Collection &parentCollection, bool saveHead, bool saveBody );
+    bool writeNoteFile( const QString &filePath, const QString &data, QString *errorString = 0 );
     void setItemPayload( Akonadi::Item & item, QString file, QString data );
+    void setItemMetadata( Akonadi::Item &item, NoteMetadataAttribute *metadata ) const;
 
     void initializeDirectory( const QString &path ) const;
-    Akonadi::Collection::List createCollectionsForDirectory( const QDir &parentDirectory, const Akonadi::Collection &parentCollection ) const;
+    void buildCollectionTree( const QDir &parentDirectory, int parentNode );
+    Akonadi::Collection::List collectionsForTree() const;
+    Akonadi::Collection collectionForNode( int node ) const;
     Akonadi::Collection::Rights supportedRights( bool isResourceCollection ) const;
 
     QString directoryForCollection( const Akonadi::Collection &collection ) const;
     Akonadi::Collection collectionForDirectory( const QString & path ) const;
 
-    bool removeDirectory( const QDir &directory );
+    void synchronizeDirectory( const QString &dir );
+    bool subdirectoriesChanged( const QString &dir ) const;
+    void updateItemForFile( const QString &file );
+    void renameKnownItem( const QString &sourceFilePath, const QString &targetFilePath );
+    KnownFile *rememberFile( const QFileInfo &fileInfo );
+    FileIdentity knownIdentityForPath( const QString &filePath ) const;
+    void forgetFile( const QString &filePath );
+    void forgetMissingFiles( const QStringList &directories, const QSet<QString> &existingFiles );
+    void relocateKnownFiles( const QString &oldPath, const QString &newPath );
 
     QString baseDirectoryPath() const;
-    
+    QStringList baseDirectoryPaths() const;
+    QString rootDirectoryForPath( const QString &path ) const;
+    QString rootDirectoryForPath( const QString &path, const QStringList &roots ) const;
+
     bool isIgnored( QString file ) const;
+    bool isIgnoredPath( const QString &path, const QString &root ) const;
+
+    void updateGitWatching();
+    QStringList lockedGitRoots() const;
+    QString readGitHead( const QString &root ) const;
+    void gitHeadChanged( const QString &root );
+    void markFileChanged( const QString &file, const QString &root );
+    void markDirectoryChanged( const QString &dir, const QString &root );
 
   private:
     PlainNotesResourceSettings * mSettings;
     KDirWatch * mFsWatcher;
+    QDirIterator * mItemScanner; // Directory being delivered by retrieveItems(), chunk by chunk
+    PayloadCache * mPayloadCache;
+    JobDispatcher * mDispatcher; // Runs the jobs caused by file system changes
+
+    QHash<FileIdentity, KnownFile> mKnownFiles; // Last seen location of every scanned note, used for rename detection
+    QSet<QString> mDirtyDirectories;
+    QSet<QString> mDirtyFiles;
+    QStringList mDirectoriesAwaitingRenames;
+    QTimer * mDirtyTimer;
+    int mPendingRenames;
+
+    QHash<Akonadi::Item::Id, PendingWrite> mPendingWrites; // Latest body of rapidly changed items, written out by mWriteTimer
+    QTimer * mWriteTimer;
+    bool mWritesFailing;
+
+    QHash<TreeOperation*, PendingTreeOperation> mTreeOperations; // Changes waiting for their background operation
+
+    CollectionTree mCollectionTree;
+    bool mCollectionTreeDirty; // Directories were added or removed below a known one
+
+    QStringList mGitRoots; // Notes directories which are git work trees, with git integration enabled
+    QHash<QString, QString> mGitHeads; // Commit the notes of each git root were last synchronized with
+    QHash<KProcess*, QString> mGitDiffRoots; // Running git diff -> root it was started in
 
     QString mItemMimeType;
     QStringList mSupportedMimeTypes;
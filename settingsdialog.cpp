@@ -22,6 +22,7 @@
 
 #include <KConfigDialogManager>
 #include <KUrlRequester>
+#include <KEditListBox>
 #include <KLineEdit>
 #include <KWindowSystem>
 
@@ -41,6 +42,10 @@ SettingsDialog::SettingsDialog( PlainNotesResourceSettings *settings, WId window
   ui.kcfg_Path->setMode( KFile::Directory | KFile::ExistingOnly );
   ui.kcfg_Path->setUrl( KUrl( mSettings->path() ) );
 
+  KUrlRequester *additionalPathRequester = new KUrlRequester( this );
+  additionalPathRequester->setMode( KFile::Directory | KFile::ExistingOnly | KFile::LocalOnly );
+  ui.kcfg_AdditionalPaths->setCustomEditor( KEditListBox::CustomEditor( additionalPathRequester, additionalPathRequester->lineEdit() ) );
+
   connect( this, SIGNAL(okClicked()), SLOT(save()) );
   connect( ui.kcfg_Path, SIGNAL(textChanged(QString)), SLOT(validate()) );
   connect( ui.kcfg_ReadOnly, SIGNAL(toggled(bool)), SLOT(validate()) );
@@ -84,6 +89,7 @@ void SettingsDialog::save()
   mManager->updateSettings();
   QString path = ui.kcfg_Path->url().isLocalFile() ? ui.kcfg_Path->url().toLocalFile() : ui.kcfg_Path->url().path();
   mSettings->setPath( path );
+  mSettings->setAdditionalPaths( ui.kcfg_AdditionalPaths->items() );
   mSettings->writeConfig();
 
   if ( ui.kcfg_Path->url().isLocalFile() ) {
@@ -0,0 +1,603 @@
+#include "treeoperation.h"
+
+#include <config-plainnotes.h>
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QtConcurrentRun>
+
+#include <errno.h>
+#include <string.h>
+
+#ifndef Q_OS_WIN
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#endif
+
+#define MAX_PARALLEL_REMOVALS 4 // Number of directories removed at the same time
+#define COPY_BUFFER_SIZE 65536
+
+#ifndef Q_OS_WIN
+
+struct DirectoryEntry
+{
+  QByteArray name;
+  bool isDirectory;
+};
+
+// Lists a directory without changing the offset of the passed descriptor
+static bool readDirectory( int dirFd, QList<DirectoryEntry> &entries )
+{
+  const int fd = dup( dirFd );
+  DIR *dir = fd < 0 ? 0 : fdopendir( fd );
+
+  if ( !dir ) {
+    if ( fd >= 0 )
+      close( fd );
+    return false;
+  }
+
+  struct dirent *entry;
+  while ( ( entry = readdir( dir ) ) ) {
+    if ( qstrcmp( entry->d_name, "." ) == 0 || qstrcmp( entry->d_name, ".." ) == 0 )
+      continue;
+
+    DirectoryEntry e;
+    e.name = entry->d_name;
+
+    if ( entry->d_type != DT_UNKNOWN ) {
+      e.isDirectory = entry->d_type == DT_DIR;
+    } else {
+      struct stat info;
+      e.isDirectory = fstatat( dirFd, entry->d_name, &info, AT_SYMLINK_NOFOLLOW ) == 0 && S_ISDIR( info.st_mode );
+    }
+
+    entries << e;
+  }
+
+  closedir( dir );
+  return true;
+}
+
+// A directory being removed, it goes away once its own entries and all subdirectories are gone
+struct RemovalNode
+{
+  RemovalNode *parent;
+  int parentFd;       // Descriptor of the containing directory, owned by the parent node
+  QByteArray name;
+  QString path;       // For error messages only, never used to access the file system
+  int fd;             // Kept open until all subdirectories are gone, they are removed relative to it
+  QAtomicInt pending; // 1 while the directory itself is listed, plus one per queued subdirectory
+};
+
+class RemoveDirectoryTask : public QRunnable
+{
+  public:
+    RemoveDirectoryTask( TreeOperation *operation, RemovalNode *node )
+      : mOperation( operation ), mNode( node )
+    {
+    }
+
+    void run()
+    {
+      mOperation->removeDirectory( mNode );
+    }
+
+  private:
+    TreeOperation *mOperation;
+    RemovalNode *mNode;
+};
+
+#endif
+
+TreeOperation::TreeOperation( QObject *parent )
+  : QObject( parent ),
+  mMode( Remove ),
+  mPhaseStart( 0 ),
+  mPhaseSpan( 100 ),
+  mTotal( 1 )
+{
+  mPool.setMaxThreadCount( MAX_PARALLEL_REMOVALS );
+
+  connect( &mWatcher, SIGNAL(finished()), SLOT(workFinished()) );
+}
+
+TreeOperation::~TreeOperation()
+{
+  mWatcher.waitForFinished();
+}
+
+void TreeOperation::startRemove( const QString &path )
+{
+  mMode = Remove;
+  mSourcePath = path;
+
+  mWatcher.setFuture( QtConcurrent::run( this, &TreeOperation::run ) );
+}
+
+void TreeOperation::startMove( const QString &sourcePath, const QString &targetPath )
+{
+  mMode = Move;
+  mSourcePath = sourcePath;
+  mTargetPath = targetPath;
+
+  mWatcher.setFuture( QtConcurrent::run( this, &TreeOperation::run ) );
+}
+
+QString TreeOperation::errorString() const
+{
+  QMutexLocker locker( &mErrorMutex );
+  return mErrorString;
+}
+
+void TreeOperation::workFinished()
+{
+  emit finished( mWatcher.result() );
+}
+
+#ifndef Q_OS_WIN
+
+bool TreeOperation::run()
+{
+  if ( mMode == Remove ) {
+    const int fd = open( QFile::encodeName( mSourcePath ).constData(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW );
+    if ( fd < 0 ) {
+      setError( mSourcePath, errno );
+      return false;
+    }
+
+    qint64 bytes = 0;
+    int entries = 0;
+    measureTree( fd, bytes, entries );
+    close( fd );
+
+    startPhase( 0, 100, entries );
+
+    return removeTree( mSourcePath );
+  }
+
+  if ( ::rename( QFile::encodeName( mSourcePath ).constData(), QFile::encodeName( mTargetPath ).constData() ) == 0 )
+    return true;
+
+  if ( errno != EXDEV ) {
+    setError( mTargetPath, errno );
+    return false;
+  }
+
+  // Different filesystems, copy everything over and remove the source afterwards
+  const int sourceFd = open( QFile::encodeName( mSourcePath ).constData(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW );
+  if ( sourceFd < 0 ) {
+    setError( mSourcePath, errno );
+    return false;
+  }
+
+  struct stat info;
+  if ( fstat( sourceFd, &info ) != 0 || mkdir( QFile::encodeName( mTargetPath ).constData(), info.st_mode & 07777 ) != 0 ) {
+    setError( mTargetPath, errno );
+    close( sourceFd );
+    return false;
+  }
+
+  const int targetFd = open( QFile::encodeName( mTargetPath ).constData(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW );
+  if ( targetFd < 0 ) {
+    setError( mTargetPath, errno );
+    close( sourceFd );
+    return false;
+  }
+
+  qint64 bytes = 0;
+  int entries = 0;
+  measureTree( sourceFd, bytes, entries );
+
+  // Copying takes most of the time, removing the source afterwards is comparatively cheap
+  startPhase( 0, 90, bytes / 1024 );
+
+  const bool copied = copyTree( sourceFd, targetFd, mTargetPath );
+
+  close( targetFd );
+  close( sourceFd );
+
+  if ( !copied ) {
+    removeTree( mTargetPath ); // Don't leave a partial copy behind, the first error is kept
+    return false;
+  }
+
+  startPhase( 90, 10, entries );
+
+  return removeTree( mSourcePath );
+}
+
+bool TreeOperation::removeTree( const QString &path )
+{
+  const int previousErrors = mErrors;
+
+  const QFileInfo info( path );
+  const int parentFd = open( QFile::encodeName( info.path() ).constData(), O_RDONLY | O_DIRECTORY );
+  if ( parentFd < 0 ) {
+    setError( info.path(), errno );
+    return false;
+  }
+
+  RemovalNode *root = new RemovalNode;
+  root->parent = 0;
+  root->parentFd = parentFd;
+  root->name = QFile::encodeName( info.fileName() );
+  root->path = path;
+  root->fd = -1;
+  root->pending = 1;
+
+  // Tasks queue their subdirectories themselves, so this returns once the whole tree is gone
+  mPool.start( new RemoveDirectoryTask( this, root ) );
+  mPool.waitForDone();
+
+  close( parentFd );
+
+  return mErrors == previousErrors;
+}
+
+void TreeOperation::removeDirectory( RemovalNode *node )
+{
+  // Relative to the parent and without following symlinks, so a swapped path component can't redirect the removal
+  node->fd = openat( node->parentFd, node->name.constData(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW );
+
+  QList<DirectoryEntry> entries;
+
+  if ( node->fd < 0 || !readDirectory( node->fd, entries ) ) {
+    setError( node->path, errno );
+  } else {
+    foreach ( const DirectoryEntry &entry, entries ) {
+      const QString entryPath = node->path + QLatin1Char( '/' ) + QFile::decodeName( entry.name );
+
+      if ( entry.isDirectory ) {
+        RemovalNode *child = new RemovalNode;
+        child->parent = node;
+        child->parentFd = node->fd;
+        child->name = entry.name;
+        child->path = entryPath;
+        child->fd = -1;
+        child->pending = 1;
+
+        node->pending.ref();
+        mPool.start( new RemoveDirectoryTask( this, child ) );
+      } else {
+        if ( unlinkat( node->fd, entry.name.constData(), 0 ) != 0 )
+          setError( entryPath, errno );
+
+        addProgress( 1 );
+      }
+    }
+  }
+
+  finishDirectory( node );
+}
+
+void TreeOperation::finishDirectory( RemovalNode *node )
+{
+  // Whoever drops the last reference removes the directory and continues with its parent
+  while ( node && !node->pending.deref() ) {
+    if ( node->fd >= 0 )
+      close( node->fd );
+
+    if ( unlinkat( node->parentFd, node->name.constData(), AT_REMOVEDIR ) != 0 )
+      setError( node->path, errno ); // Only the first error is kept, so a failure below wins over ENOTEMPTY
+
+    addProgress( 1 );
+
+    RemovalNode *parent = node->parent;
+    delete node;
+    node = parent;
+  }
+}
+
+bool TreeOperation::copyTree( int sourceDirFd, int targetDirFd, const QString &path )
+{
+  QList<DirectoryEntry> entries;
+  if ( !readDirectory( sourceDirFd, entries ) ) {
+    setError( path, errno );
+    return false;
+  }
+
+  foreach ( const DirectoryEntry &entry, entries ) {
+    const char *name = entry.name.constData();
+    const QString entryPath = path + QLatin1Char( '/' ) + QFile::decodeName( entry.name );
+
+    struct stat info;
+    if ( fstatat( sourceDirFd, name, &info, AT_SYMLINK_NOFOLLOW ) != 0 ) {
+      setError( entryPath, errno );
+      return false;
+    }
+
+    if ( S_ISDIR( info.st_mode ) ) {
+      if ( mkdirat( targetDirFd, name, info.st_mode & 07777 ) != 0 ) {
+        setError( entryPath, errno );
+        return false;
+      }
+
+      const int sourceFd = openat( sourceDirFd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW );
+      const int targetFd = sourceFd < 0 ? -1 : openat( targetDirFd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW );
+
+      if ( targetFd < 0 ) {
+        setError( entryPath, errno );
+        if ( sourceFd >= 0 )
+          close( sourceFd );
+        return false;
+      }
+
+      const bool copied = copyTree( sourceFd, targetFd, entryPath );
+
+      close( targetFd );
+      close( sourceFd );
+
+      if ( !copied )
+        return false;
+    } else if ( S_ISREG( info.st_mode ) ) {
+      if ( !copyFile( sourceDirFd, targetDirFd, name, info, entryPath ) )
+        return false;
+    } else if ( S_ISLNK( info.st_mode ) ) {
+      char target[PATH_MAX];
+      const ssize_t length = readlinkat( sourceDirFd, name, target, sizeof( target ) - 1 );
+
+      if ( length < 0 ) {
+        setError( entryPath, errno );
+        return false;
+      }
+
+      target[length] = '\0';
+
+      if ( symlinkat( target, targetDirFd, name ) != 0 ) {
+        setError( entryPath, errno );
+        return false;
+      }
+    } // Sockets, fifos and devices have no business in a notes folder, skip them
+  }
+
+  return true;
+}
+
+bool TreeOperation::copyFile( int sourceDirFd, int targetDirFd, const char *name, const struct stat &info, const QString &path )
+{
+  const int in = openat( sourceDirFd, name, O_RDONLY | O_NOFOLLOW );
+  if ( in < 0 ) {
+    setError( path, errno );
+    return false;
+  }
+
+  const int out = openat( targetDirFd, name, O_WRONLY | O_CREAT | O_EXCL, info.st_mode & 07777 );
+  if ( out < 0 ) {
+    setError( path, errno );
+    close( in );
+    return false;
+  }
+
+  bool ok = true;
+  bool done = false;
+  qint64 pendingBytes = 0;
+
+#ifdef HAVE_COPY_FILE_RANGE
+  // Let the kernel copy the data where the filesystems support it
+  while ( !done ) {
+    const ssize_t copied = copy_file_range( in, 0, out, 0, COPY_BUFFER_SIZE * 16, 0 );
+
+    if ( copied < 0 ) {
+      if ( errno == EINTR )
+        continue;
+
+      if ( errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP ) {
+        setError( path, errno );
+        ok = false;
+      }
+
+      break; // Not supported here, continue with read()/write() from the current offsets
+    }
+
+    if ( copied == 0 )
+      done = true;
+
+    pendingBytes += copied;
+    if ( pendingBytes >= 1024 ) {
+      addProgress( pendingBytes / 1024 );
+      pendingBytes %= 1024;
+    }
+  }
+#endif
+
+  char buffer[COPY_BUFFER_SIZE];
+
+  while ( ok && !done ) {
+    const ssize_t count = read( in, buffer, sizeof( buffer ) );
+
+    if ( count < 0 ) {
+      if ( errno == EINTR )
+        continue;
+
+      setError( path, errno );
+      ok = false;
+      break;
+    }
+
+    if ( count == 0 ) {
+      done = true;
+      break;
+    }
+
+    for ( ssize_t written = 0; written < count; ) {
+      const ssize_t result = write( out, buffer + written, count - written );
+
+      if ( result < 0 ) {
+        if ( errno == EINTR )
+          continue;
+
+        setError( path, errno );
+        ok = false;
+        break;
+      }
+
+      written += result;
+    }
+
+    pendingBytes += count;
+    if ( pendingBytes >= 1024 ) {
+      addProgress( pendingBytes / 1024 );
+      pendingBytes %= 1024;
+    }
+  }
+
+  // Keep the modification time, it is shown as the note's date
+  if ( ok ) {
+#if defined(HAVE_STRUCT_STAT_ST_MTIM)
+    const struct timespec times[2] = { info.st_atim, info.st_mtim };
+#elif defined(HAVE_STRUCT_STAT_ST_MTIMESPEC)
+    const struct timespec times[2] = { info.st_atimespec, info.st_mtimespec };
+#else
+    struct timespec times[2];
+    times[0].tv_sec = info.st_atime;
+    times[0].tv_nsec = 0;
+    times[1].tv_sec = info.st_mtime;
+    times[1].tv_nsec = 0;
+#endif
+    futimens( out, times );
+  }
+
+  close( in );
+
+  if ( close( out ) != 0 && ok ) {
+    setError( path, errno );
+    ok = false;
+  }
+
+  return ok;
+}
+
+void TreeOperation::measureTree( int dirFd, qint64 &bytes, int &entries ) const
+{
+  QList<DirectoryEntry> list;
+  if ( !readDirectory( dirFd, list ) )
+    return;
+
+  entries += list.count();
+
+  foreach ( const DirectoryEntry &entry, list ) {
+    if ( entry.isDirectory ) {
+      const int fd = openat( dirFd, entry.name.constData(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW );
+
+      if ( fd >= 0 ) {
+        measureTree( fd, bytes, entries );
+        close( fd );
+      }
+    } else {
+      struct stat info;
+
+      if ( fstatat( dirFd, entry.name.constData(), &info, AT_SYMLINK_NOFOLLOW ) == 0 && S_ISREG( info.st_mode ) )
+        bytes += info.st_size;
+    }
+  }
+}
+
+#else
+
+// Without descriptor based file system calls the tree is handled by path, sequentially and without progress
+static bool removePath( const QString &path, QString &failedPath )
+{
+  QDir dir( path );
+
+  foreach ( const QFileInfo &entry, dir.entryInfoList( QDir::AllEntries | QDir::Hidden | QDir::System | QDir::NoDotAndDotDot ) ) {
+    if ( entry.isDir() && !entry.isSymLink() ) {
+      if ( !removePath( entry.filePath(), failedPath ) )
+        return false;
+    } else if ( !QFile::remove( entry.filePath() ) ) {
+      failedPath = entry.filePath();
+      return false;
+    }
+  }
+
+  if ( !dir.rmdir( path ) ) {
+    failedPath = path;
+    return false;
+  }
+
+  return true;
+}
+
+static bool copyPath( const QString &sourcePath, const QString &targetPath, QString &failedPath )
+{
+  if ( !QDir().mkdir( targetPath ) ) {
+    failedPath = targetPath;
+    return false;
+  }
+
+  foreach ( const QFileInfo &entry, QDir( sourcePath ).entryInfoList( QDir::AllEntries | QDir::Hidden | QDir::System | QDir::NoDotAndDotDot ) ) {
+    const QString target = targetPath + QLatin1Char( '/' ) + entry.fileName();
+
+    if ( entry.isDir() && !entry.isSymLink() ) {
+      if ( !copyPath( entry.filePath(), target, failedPath ) )
+        return false;
+    } else if ( !QFile::copy( entry.filePath(), target ) ) {
+      failedPath = entry.filePath();
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool TreeOperation::run()
+{
+  QString failedPath;
+
+  if ( mMode == Move && !QDir().rename( mSourcePath, mTargetPath ) ) {
+    if ( !copyPath( mSourcePath, mTargetPath, failedPath ) ) {
+      setError( failedPath, EIO );
+
+      QString ignored;
+      removePath( mTargetPath, ignored ); // Don't leave a partial copy behind
+      return false;
+    }
+  } else if ( mMode == Move ) {
+    return true;
+  }
+
+  if ( !removePath( mSourcePath, failedPath ) ) {
+    setError( failedPath, EIO );
+    return false;
+  }
+
+  return true;
+}
+
+#endif
+
+void TreeOperation::startPhase( int start, int span, int total )
+{
+  mPhaseStart = start;
+  mPhaseSpan = span;
+  mTotal = qMax( 1, total );
+  mDone = 0;
+}
+
+void TreeOperation::addProgress( int units )
+{
+  if ( units <= 0 )
+    return;
+
+  const int before = mDone.fetchAndAddOrdered( units );
+  const int oldPercent = mPhaseStart + qMin( qint64( before ), qint64( mTotal ) ) * mPhaseSpan / mTotal;
+  const int newPercent = mPhaseStart + qMin( qint64( before ) + units, qint64( mTotal ) ) * mPhaseSpan / mTotal;
+
+  if ( newPercent != oldPercent )
+    emit progress( newPercent );
+}
+
+void TreeOperation::setError( const QString &path, int error )
+{
+  QMutexLocker locker( &mErrorMutex );
+
+  mErrors.ref();
+
+  if ( mErrorString.isEmpty() ) // Keep the first error, later ones are usually caused by it
+    mErrorString = QString::fromLatin1( "%1: %2" ).arg( path, QString::fromLocal8Bit( strerror( error ) ) );
+}
+
+#include "treeoperation.moc"
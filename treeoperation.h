@@ -0,0 +1,75 @@
+#ifndef TREEOPERATION_H
+#define TREEOPERATION_H
+
+#include <QFutureWatcher>
+#include <QMutex>
+#include <QObject>
+#include <QThreadPool>
+
+#include <sys/stat.h>
+
+struct RemovalNode;
+
+/**
+ * Removes or moves a directory tree in a worker thread.
+ *
+ * Removal works on directory file descriptors (openat()/unlinkat()), every
+ * subdirectory is queued to a thread pool of bounded size. Moves are done with
+ * a plain rename() when possible and fall back to a streaming copy followed
+ * by a removal of the source when crossing filesystems. Without the POSIX
+ * descriptor calls (Windows) both are done by path, sequentially.
+ */
+class TreeOperation : public QObject
+{
+  Q_OBJECT
+
+  public:
+    explicit TreeOperation( QObject *parent = 0 );
+    ~TreeOperation();
+
+    void startRemove( const QString &path );
+    void startMove( const QString &sourcePath, const QString &targetPath );
+
+    QString errorString() const;
+
+  Q_SIGNALS:
+    void progress( int percent );
+    void finished( bool success );
+
+  private Q_SLOTS:
+    void workFinished();
+
+  private:
+    bool run();
+    bool removeTree( const QString &path );
+    void removeDirectory( RemovalNode *node );
+    void finishDirectory( RemovalNode *node );
+    bool copyTree( int sourceDirFd, int targetDirFd, const QString &path );
+    bool copyFile( int sourceDirFd, int targetDirFd, const char *name, const struct stat &info, const QString &path );
+    void measureTree( int dirFd, qint64 &bytes, int &entries ) const;
+    void startPhase( int start, int span, int total );
+    void addProgress( int units );
+    void setError( const QString &path, int error );
+
+    enum Mode { Remove, Move };
+
+    Mode mMode;
+    QString mSourcePath;
+    QString mTargetPath;
+    QString mErrorString;
+    mutable QMutex mErrorMutex;
+
+    // Progress of the current phase is mapped to [mPhaseStart, mPhaseStart + mPhaseSpan] percent
+    int mPhaseStart;
+    int mPhaseSpan;
+    int mTotal;
+    QAtomicInt mDone; // progress units, entries for removal and KiB for copying
+    QAtomicInt mErrors;
+
+    QThreadPool mPool;
+    QFutureWatcher<bool> mWatcher;
+
+    friend class RemoveDirectoryTask;
+};
+
+#endif